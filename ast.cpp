@@ -2,7 +2,8 @@
 #include "lex.h"
 
 std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-std::map<std::string, ResourceTrackerSP *> FunctionRTs;
+std::map<std::string, ResourceTrackerSP> FunctionRTs;
+std::map<std::string, std::unique_ptr<RecordAST>> RecordTypes;
 
 ExprAST::~ExprAST() = default;
 NumberExprAST::NumberExprAST(double Val) : ExprAST(NumberExpr), Val(Val) {}
@@ -22,9 +23,25 @@ UnaryExprAST::UnaryExprAST(std::string Op, std::unique_ptr<ExprAST> Operand)
 // PrototypeAST
 PrototypeAST::PrototypeAST(SourceLocation DefLoc, const std::string &Name,
                            std::vector<std::string> Args, bool IsOperator,
-                           unsigned Prec)
+                           unsigned Prec, unsigned Attributes)
     : Name(Name), Args(Args), IsOperator(IsOperator), Precedence(Prec),
-      LocationLine(DefLoc.line) {}
+      LocationLine(DefLoc.line), Attributes(Attributes) {}
+
+unsigned PrototypeAST::get_attribute(const std::string &name) {
+  if (name == "pure")
+    return Pure;
+  if (name == "readonly")
+    return ReadOnly;
+  if (name == "inline")
+    return Inline;
+  if (name == "noinline")
+    return NoInline;
+  if (name == "hot")
+    return Hot;
+  if (name == "cold")
+    return Cold;
+  return 0;
+}
 
 const std::string &PrototypeAST::get_name() const { return Name; }
 bool PrototypeAST::is_unary_op() const {
@@ -35,6 +52,26 @@ bool PrototypeAST::is_binary_op() const {
 }
 unsigned PrototypeAST::get_binary_precedence() const { return Precedence; }
 
+std::string PrototypeAST::to_extern() const {
+  static const std::pair<FnAttr, const char *> attribute_names[] = {
+      {Pure, "pure"}, {ReadOnly, "readonly"}, {Inline, "inline"},
+      {NoInline, "noinline"}, {Hot, "hot"}, {Cold, "cold"}};
+
+  std::string source = "extern";
+  for (auto &[attribute, name] : attribute_names)
+    if (Attributes & attribute)
+      source += std::string(" ") + name;
+  source += " " + Name;
+  if (is_binary_op())
+    source += " " + std::to_string(Precedence);
+  if (IsOperator)
+    source += " ";
+  source += "(";
+  for (size_t i = 0; i < Args.size(); ++i)
+    source += (i ? " " : "") + Args[i];
+  return source + ");";
+}
+
 const std::string PrototypeAST::get_operator_name() const {
   assert(is_unary_op() || is_binary_op());
   std::string search_string = is_unary_op() ? "unary" : "binary";
@@ -55,18 +92,65 @@ const std::string &FunctionAST::get_name() const { return Proto->get_name(); }
 IfExprAST::IfExprAST(std::unique_ptr<ExprAST> Condition,
                      std::unique_ptr<ExprAST> Then,
                      std::unique_ptr<ExprAST> Else)
-    : ExprAST(CallExpr), Condition(std::move(Condition)), Then(std::move(Then)),
+    : ExprAST(IfExpr), Condition(std::move(Condition)), Then(std::move(Then)),
       Else(std::move(Else)) {}
 
 ForExprAST::ForExprAST(std::string VariableName, std::unique_ptr<ExprAST> Start,
                        std::unique_ptr<ExprAST> Condition,
                        std::unique_ptr<ExprAST> Step,
-                       std::unique_ptr<ExprAST> Body)
+                       std::unique_ptr<ExprAST> Body, std::string Reduction,
+                       LoopHints Hints)
     : ExprAST(ForExpr), VarName(VariableName), Start(std::move(Start)),
       Condition(std::move(Condition)), Step(std::move(Step)),
+      Body(std::move(Body)), Reduction(std::move(Reduction)), Hints(Hints) {}
+
+bool ForExprAST::is_reduction(const std::string &name) {
+  return name == "sum" || name == "prod" || name == "min" || name == "max";
+}
+
+WhileExprAST::WhileExprAST(std::unique_ptr<ExprAST> Condition,
+                           std::unique_ptr<ExprAST> Body)
+    : ExprAST(WhileExpr), Condition(std::move(Condition)),
       Body(std::move(Body)) {}
 
+BreakExprAST::BreakExprAST(SourceLocation loc, std::unique_ptr<ExprAST> Val)
+    : ExprAST(BreakExpr, loc), Val(std::move(Val)) {}
+
+ContinueExprAST::ContinueExprAST(SourceLocation loc,
+                                 std::unique_ptr<ExprAST> Val)
+    : ExprAST(ContinueExpr, loc), Val(std::move(Val)) {}
+
+MatchExprAST::MatchExprAST(std::unique_ptr<ExprAST> Key,
+                           std::vector<MatchArm> Arms,
+                           std::unique_ptr<ExprAST> Else)
+    : ExprAST(MatchExpr), Key(std::move(Key)), Arms(std::move(Arms)),
+      Else(std::move(Else)) {}
+
 WithExprAST::WithExprAST(VariableVector Variables,
                          std::unique_ptr<ExprAST> Body)
     : ExprAST(WithExpr), Variables(std::move(Variables)),
       Body(std::move(Body)) {}
+
+// Records
+RecordAST::RecordAST(const std::string &Name, std::vector<RecordField> Fields,
+                     RecordLayout Layout)
+    : Name(Name), Fields(std::move(Fields)), Layout(Layout) {}
+
+int RecordAST::get_field_index(const std::string &field) const {
+  for (unsigned i = 0, e = Fields.size(); i != e; ++i)
+    if (Fields[i].Name == field)
+      return i;
+  return -1;
+}
+
+RecordArrayExprAST::RecordArrayExprAST(const RecordAST *Record,
+                                       std::unique_ptr<ExprAST> Count,
+                                       RecordLayout Layout)
+    : ExprAST(RecordArrayExpr), Record(Record), Count(std::move(Count)),
+      Layout(Layout) {}
+
+FieldExprAST::FieldExprAST(SourceLocation loc, const std::string &ArrayName,
+                           const std::string &FieldName,
+                           std::unique_ptr<ExprAST> Index)
+    : ExprAST(FieldExpr, loc), ArrayName(ArrayName), FieldName(FieldName),
+      Index(std::move(Index)) {}
@@ -6,12 +6,15 @@
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/ModRef.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Support/Casting.h" // important for llvm-style RTTI
 #include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -19,6 +22,15 @@
 using namespace llvm;
 using namespace llvm::orc;
 
+struct TailCallScan;
+struct LoopTarget;
+struct LocalVariable;
+
+// Names an expression reads and assigns with `=`, nested scopes included
+struct VariableUses {
+  std::set<std::string> Read, Assigned;
+};
+
 class ExprAST {
 public:
   enum ExprKind {
@@ -29,7 +41,13 @@ public:
     CallExpr,
     IfExpr,
     ForExpr,
-    WithExpr
+    WithExpr,
+    RecordArrayExpr,
+    FieldExpr,
+    WhileExpr,
+    BreakExpr,
+    ContinueExpr,
+    MatchExpr
   };
 
 private:
@@ -44,6 +62,22 @@ public:
 
   virtual ~ExprAST();
   virtual Value *codegen() = 0;
+  // Value of the expression as an i1 for branches and selects. Comparisons
+  // and logical operators produce it directly instead of going through a
+  // double.
+  virtual Value *codegen_cond();
+
+  // Rough instruction count of evaluating the expression unconditionally,
+  // or NOT_SPECULATABLE when it has side effects (or may trap) and has to
+  // stay behind a branch.
+  static constexpr unsigned NOT_SPECULATABLE = ~0u;
+  virtual unsigned speculation_cost() const { return NOT_SPECULATABLE; }
+
+  // Called on expressions whose value is returned by the function being
+  // defined, to find the calls that can become jumps or `tail` calls.
+  virtual void mark_tail_calls(TailCallScan &scan) {}
+
+  virtual void collect_variables(VariableUses &uses) const {}
 
   int get_line() const { return location.line; }
   int get_col() const { return location.col; }
@@ -55,6 +89,8 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double Val);
   Value *codegen() override;
+  unsigned speculation_cost() const override;
+  double get_value() const { return Val; }
   static bool classof(const ExprAST *E) { return E->getKind() == NumberExpr; }
 };
 
@@ -64,18 +100,39 @@ class VariableExprAST : public ExprAST {
 public:
   VariableExprAST(const std::string &Name);
   Value *codegen() override;
+  unsigned speculation_cost() const override;
+  void collect_variables(VariableUses &uses) const override;
   const std::string &get_name() const { return Name; }
   static bool classof(const ExprAST *E) { return E->getKind() == VariableExpr; }
 };
 
+class CallExprAST;
+
 class BinaryExprAST : public ExprAST {
   std::string Op;
   std::unique_ptr<ExprAST> LHS, RHS;
+  // `x + f(...)`/`x * f(...)` in tail position of f
+  CallExprAST *RecursiveCall = nullptr;
+  ExprAST *AccumulatedOperand = nullptr;
+  bool Accumulates = false;
+  // `x : f(...)` with a `binary:` returning its RHS, x is only evaluated
+  bool Sequences = false;
+
+  Value *codegen_short_circuit();
+  Value *codegen_accumulation();
 
 public:
   BinaryExprAST(SourceLocation binop_loc, std::string Op,
                 std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS);
   Value *codegen() override;
+  Value *codegen_cond() override;
+  unsigned speculation_cost() const override;
+  void mark_tail_calls(TailCallScan &scan) override;
+  void collect_variables(VariableUses &uses) const override;
+  const std::string &get_op() const { return Op; }
+  ExprAST *get_lhs() const { return LHS.get(); }
+  ExprAST *get_rhs() const { return RHS.get(); }
+  void enable_accumulation();
   static bool classof(const ExprAST *E) { return E->getKind() == BinaryExpr; }
 };
 
@@ -86,36 +143,80 @@ class UnaryExprAST : public ExprAST {
 public:
   UnaryExprAST(std::string Op, std::unique_ptr<ExprAST> Operand);
   Value *codegen() override;
+  Value *codegen_cond() override;
+  unsigned speculation_cost() const override;
+  void collect_variables(VariableUses &uses) const override;
+  const std::string &get_op() const { return Op; }
+  ExprAST *get_operand() const { return Operand.get(); }
   static bool classof(const ExprAST *E) { return E->getKind() == UnaryExpr; }
 };
 
 class CallExprAST : public ExprAST {
   std::string Callee;
   std::vector<std::unique_ptr<ExprAST>> Args;
+  bool IsTail = false;
+
+  Value *codegen_self_tail_call();
 
 public:
   CallExprAST(SourceLocation FnNameLoc, const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args);
   Value *codegen() override;
+  unsigned speculation_cost() const override;
+  void mark_tail_calls(TailCallScan &scan) override;
+  void collect_variables(VariableUses &uses) const override;
+  const std::string &get_callee() const { return Callee; }
   static bool classof(const ExprAST *E) { return E->getKind() == CallExpr; }
 };
 
 class PrototypeAST {
+public:
+  // Annotations written before the name in `def`/`extern`
+  enum FnAttr : unsigned {
+    Pure = 1 << 0,     // memory(none) nounwind willreturn
+    ReadOnly = 1 << 1, // memory(read) nounwind willreturn
+    Inline = 1 << 2,   // alwaysinline
+    NoInline = 1 << 3,
+    Hot = 1 << 4,
+    Cold = 1 << 5
+  };
+  static unsigned get_attribute(const std::string &name);
+
+private:
   std::string Name;
   std::vector<std::string> Args;
   bool IsOperator;
   unsigned Precedence;
   unsigned LocationLine;
+  unsigned Attributes;
+  // Inferred from the compiled body, see record_inferred_attributes
+  MemoryEffects InferredMemory = MemoryEffects::unknown();
+  bool InferredNoUnwind = false;
+  bool ReturnsLastArg = false; // e.g. the library's `binary:`
+  bool HasBody = false; // defined with `def` rather than `extern`
 
 public:
-  PrototypeAST(SourceLocation DefLoc, const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0);
+  PrototypeAST(SourceLocation DefLoc, const std::string &Name,
+               std::vector<std::string> Args, bool IsOperator = false,
+               unsigned Prec = 0, unsigned Attributes = 0);
   int get_arg_size() const { return Args.size(); }
+  unsigned get_attributes() const { return Attributes; }
+  // names the arguments of F and sets its attributes from this prototype
+  void apply_to(Function *F) const;
+  void record_inferred_attributes(const Function &F);
+  void record_returned_argument(const Function &F);
+  bool returns_last_arg() const { return ReturnsLastArg; }
+  // whether callers may rely on the memory effects inferred from the body
+  bool lends_inferred_memory() const;
+  bool has_body() const { return HasBody; }
+  void set_has_body() { HasBody = true; }
   const std::string &get_name() const;
   const std::string get_operator_name() const;
   bool is_unary_op() const;
   bool is_binary_op() const;
   unsigned get_binary_precedence() const;
+  // the declaration as written in a header, e.g. `extern pure binary: 1 (a b);`
+  std::string to_extern() const;
   Function *codegen();
 
   int get_line() const { return LocationLine; }
@@ -135,26 +236,114 @@ public:
 class IfExprAST : public ExprAST {
   std::unique_ptr<ExprAST> Condition, Then, Else;
 
+  bool is_speculated() const; // lowered to a select
+
 public:
   IfExprAST(std::unique_ptr<ExprAST> Condition, std::unique_ptr<ExprAST> Then,
             std::unique_ptr<ExprAST> Else);
 
   Value *codegen() override;
+  unsigned speculation_cost() const override;
+  void mark_tail_calls(TailCallScan &scan) override;
+  void collect_variables(VariableUses &uses) const override;
   static bool classof(const ExprAST *E) { return E->getKind() == IfExpr; }
 };
 
+// `unroll n`, `vectorize n` and `interleave n` of a `for`, 0 when not given
+struct LoopHints {
+  unsigned Unroll = 0, Vectorize = 0, Interleave = 0;
+};
+
+/// forexpr ::= [reduction] 'for' identifier '=' expr ',' expr ',' expr
+///             hint* 'do' expression 'end'
+/// reduction ::= 'sum' | 'prod' | 'min' | 'max'
+/// hint ::= ('unroll' | 'vectorize' | 'interleave') number
 class ForExprAST : public ExprAST {
   std::string VarName;
   std::unique_ptr<ExprAST> Start, Condition, Step, Body;
+  std::string Reduction; // empty for a loop evaluating to 0.0
+  LoopHints Hints;
+
+  bool get_counted_bound(ExprAST *&bound, std::string &op) const;
+  Value *codegen_counted(ExprAST *bound, const std::string &op);
+  LocalVariable *codegen_reduction_start();
+  void codegen_reduction_step(LocalVariable *accumulator, Value *value);
+  Value *codegen_exit(LocalVariable *accumulator, LoopTarget &target,
+                      BasicBlock *end_bb);
 
 public:
   ForExprAST(std::string VariableName, std::unique_ptr<ExprAST> Start,
              std::unique_ptr<ExprAST> Condition, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body);
+             std::unique_ptr<ExprAST> Body, std::string Reduction = "",
+             LoopHints Hints = {});
+  static bool is_reduction(const std::string &name);
   Value *codegen() override;
+  void collect_variables(VariableUses &uses) const override;
   static bool classof(const ExprAST *E) { return E->getKind() == ForExpr; }
 };
 
+class WhileExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> Condition, Body;
+
+public:
+  WhileExprAST(std::unique_ptr<ExprAST> Condition,
+               std::unique_ptr<ExprAST> Body);
+  Value *codegen() override;
+  void collect_variables(VariableUses &uses) const override;
+  static bool classof(const ExprAST *E) { return E->getKind() == WhileExpr; }
+};
+
+// `break` ends the innermost loop, which then evaluates to the value (a
+// reduction folds it in instead). `continue` ends the iteration with the
+// value as the body's. Both default to 0.0.
+class BreakExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> Val;
+
+public:
+  BreakExprAST(SourceLocation loc, std::unique_ptr<ExprAST> Val);
+  Value *codegen() override;
+  void collect_variables(VariableUses &uses) const override;
+  static bool classof(const ExprAST *E) { return E->getKind() == BreakExpr; }
+};
+
+class ContinueExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> Val;
+
+public:
+  ContinueExprAST(SourceLocation loc, std::unique_ptr<ExprAST> Val);
+  Value *codegen() override;
+  void collect_variables(VariableUses &uses) const override;
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ContinueExpr;
+  }
+};
+
+// Arms either all list integer keys, or all cover disjoint ranges of values
+struct MatchArm {
+  std::vector<double> Keys;         // `when 1, 2 then`
+  std::optional<double> Low, High;  // `when lo to hi then`: [lo, hi)
+  std::unique_ptr<ExprAST> Body;
+};
+
+class MatchExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> Key;
+  std::vector<MatchArm> Arms;
+  std::unique_ptr<ExprAST> Else; // nullptr for 0.0
+
+  void codegen_key_switch(Value *key, ArrayRef<BasicBlock *> arm_blocks,
+                          BasicBlock *else_bb);
+  void codegen_range_dispatch(Value *key, ArrayRef<BasicBlock *> arm_blocks,
+                              BasicBlock *else_bb);
+
+public:
+  MatchExprAST(std::unique_ptr<ExprAST> Key, std::vector<MatchArm> Arms,
+               std::unique_ptr<ExprAST> Else);
+  Value *codegen() override;
+  void mark_tail_calls(TailCallScan &scan) override;
+  void collect_variables(VariableUses &uses) const override;
+  static bool classof(const ExprAST *E) { return E->getKind() == MatchExpr; }
+};
+
 using VariableVector =
     std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>>;
 class WithExprAST : public ExprAST {
@@ -164,13 +353,92 @@ class WithExprAST : public ExprAST {
 public:
   WithExprAST(VariableVector Variables, std::unique_ptr<ExprAST> Body);
   Value *codegen() override;
+  void mark_tail_calls(TailCallScan &scan) override;
+  void collect_variables(VariableUses &uses) const override;
   static bool classof(const ExprAST *E) { return E->getKind() == WithExpr; }
 };
 
+// Tail positions of a function body, collected before it is generated
+struct TailCallScan {
+  std::string Function;
+  std::vector<CallExprAST *> SelfCalls;       // `f(...)`
+  std::vector<BinaryExprAST *> Accumulations; // `x + f(...)`, `x * f(...)`
+};
+
+// Records
+
+enum class RecordLayout { AoS, SoA };
+
+struct RecordField {
+  std::string Name;
+  bool IsInt; // stored as i64, converted to/from double on access
+};
+
+class RecordAST {
+  std::string Name;
+  std::vector<RecordField> Fields;
+  RecordLayout Layout; // default layout of arrays of this record
+
+public:
+  RecordAST(const std::string &Name, std::vector<RecordField> Fields,
+            RecordLayout Layout);
+  const std::string &get_name() const { return Name; }
+  const std::vector<RecordField> &get_fields() const { return Fields; }
+  RecordLayout get_layout() const { return Layout; }
+  int get_field_index(const std::string &field) const;
+  Type *get_field_type(unsigned idx) const;
+  StructType *get_struct_type() const;
+};
+
+// Storage of a `with`-bound record array while its body is generated
+struct RecordArray {
+  const RecordAST *Record;
+  RecordLayout Layout;
+  Value *Base;                     // AoS: [n x { fields }]
+  std::vector<Value *> FieldBases; // SoA: one [n x field] per field
+
+  Value *get_field_address(unsigned field, Value *index) const;
+};
+
+/// recordarray ::= record_name '(' count ')' ['layout' ('soa' | 'aos')]
+class RecordArrayExprAST : public ExprAST {
+  const RecordAST *Record;
+  std::unique_ptr<ExprAST> Count;
+  RecordLayout Layout;
+
+public:
+  RecordArrayExprAST(const RecordAST *Record, std::unique_ptr<ExprAST> Count,
+                     RecordLayout Layout);
+  Value *codegen() override;
+  void collect_variables(VariableUses &uses) const override;
+  bool codegen_array(RecordArray &array, StringRef name);
+  bool is_static() const; // size known at compile time
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == RecordArrayExpr;
+  }
+};
+
+/// fieldexpr ::= array_name '.' field_name '(' index ')'
+class FieldExprAST : public ExprAST {
+  std::string ArrayName, FieldName;
+  std::unique_ptr<ExprAST> Index;
+
+  Value *get_address(Type *&field_type);
+
+public:
+  FieldExprAST(SourceLocation loc, const std::string &ArrayName,
+               const std::string &FieldName, std::unique_ptr<ExprAST> Index);
+  Value *codegen() override;
+  void collect_variables(VariableUses &uses) const override;
+  Value *codegen_store(Value *val);
+  static bool classof(const ExprAST *E) { return E->getKind() == FieldExpr; }
+};
+
 // central maps
 //
 extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-extern std::map<std::string, ResourceTrackerSP *> FunctionRTs;
+extern std::map<std::string, std::unique_ptr<RecordAST>> RecordTypes;
+extern std::map<std::string, ResourceTrackerSP> FunctionRTs;
 
 // Error handling
 
@@ -184,6 +452,11 @@ inline std::unique_ptr<PrototypeAST> log_error_p(const char *Str) {
   return nullptr;
 }
 
+inline std::unique_ptr<RecordAST> log_error_r(const char *Str) {
+  log_error(Str);
+  return nullptr;
+}
+
 inline Value *log_error_v(const char *Str) {
   log_error(Str);
   return nullptr;
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Times kpp builds on the programs in bench/, e.g. a build of the baseline
+# against one of a branch:
+#
+#   bench/run.sh ./kpp-baseline ./kpp
+#
+# For each program it prints the best wall time of $RUNS sessions and, from
+# KPP_TIME, the number of definitions and of top level expressions with
+# their mean compile time. The builds after the first also get their
+# speedup over it. Pass the same KPP_* options to all builds when comparing
+# them.
+
+set -eo pipefail
+
+RUNS=${RUNS:-5}
+ROOT=$(realpath "$(dirname -- "$0")/..")
+
+if [ -z "$1" ]; then
+  echo "usage: $0 kpp..." >&2
+  exit 1
+fi
+
+KPPS=()
+for kpp in "$@"; do
+  KPPS+=("$(realpath -- "$kpp")")
+done
+
+cd "$ROOT" # kpp loads lib/ from the working directory
+
+# wall time of the first build for each program
+declare -A FIRST
+
+for kpp in "${KPPS[@]}"; do
+  echo "$kpp"
+  for input in bench/*.kl; do
+    best=
+    for ((run = 0; run < RUNS; ++run)); do
+      start=$(date +%s%N)
+      log=$(KPP_TIME=1 "$kpp" < "$input" 2>&1 > /dev/null | tr -d '\r')
+      elapsed=$((($(date +%s%N) - start) / 1000000))
+      if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+        best=$elapsed
+        definitions=$(echo "$log" | awk '
+          /^Time \(__anon_expr/ { esum += $(NF - 1); e++; next }
+          /^Time \(/ { dsum += $(NF - 1); d++ }
+          END {
+            if (d) printf "%d definitions, %.3f ms each  ", d, dsum / d
+            if (e) printf "%d expressions, %.3f ms each", e, esum / e
+          }')
+      fi
+    done
+    speedup=
+    if [ -z "${FIRST[$input]}" ]; then
+      FIRST[$input]=$best
+    elif [ "$best" -gt 0 ]; then
+      speedup=$(awk "BEGIN { printf \"%.2fx\", ${FIRST[$input]} / $best }")
+    fi
+    printf "  %-20s %6d ms %7s  %s\n" "$(basename "$input")" "$best" \
+      "$speedup" "$definitions"
+  done
+done
@@ -0,0 +1,148 @@
+#include "cache.h"
+#include "internal.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Host.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifndef COMPILATION
+
+std::string ObjectDiskCache::key_of(const Module &M) const {
+  std::string bitcode;
+  raw_string_ostream os(bitcode);
+  WriteBitcodeToFile(M, os);
+  os.flush();
+
+  SHA1 hasher;
+  hasher.update(bitcode);
+  // the same IR compiles differently for another target or code generator
+  hasher.update(Target);
+  hasher.update(LLVM_VERSION_STRING);
+  return toHex(hasher.result(), true);
+}
+
+// pruneCache only considers the files named llvmcache-*
+std::string ObjectDiskCache::path_of(const std::string &key) const {
+  SmallString<128> path(Dir);
+  sys::path::append(path, "llvmcache-" + key);
+  return path.str().str();
+}
+
+std::unique_ptr<MemoryBuffer> ObjectDiskCache::getObject(const Module *M) {
+  std::string key = key_of(*M);
+  std::string path = path_of(key);
+
+  auto file = sys::fs::openNativeFileForRead(path);
+  if (!file) {
+    consumeError(file.takeError());
+    std::lock_guard<std::mutex> lock(KeysMutex);
+    Keys[M] = std::move(key);
+    return nullptr;
+  }
+  auto object = MemoryBuffer::getOpenFile(*file, path, -1, false);
+  // marks the object as used, whatever the atime policy of the file system
+  (void)sys::fs::setLastAccessAndModificationTime(
+      *file, sys::TimePoint<>(std::chrono::system_clock::now()));
+  sys::fs::closeFile(*file);
+  if (!object) {
+    std::lock_guard<std::mutex> lock(KeysMutex);
+    Keys[M] = std::move(key);
+    return nullptr;
+  }
+  return std::move(*object);
+}
+
+void ObjectDiskCache::notifyObjectCompiled(const Module *M,
+                                           MemoryBufferRef Obj) {
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(KeysMutex);
+    auto found = Keys.find(M);
+    if (found == Keys.end())
+      return;
+    key = std::move(found->second);
+    Keys.erase(found);
+  }
+
+  // written aside and renamed, so that another session never loads half of
+  // an object
+  SmallString<128> model(Dir);
+  sys::path::append(model, "tmp-%%%%%%%%");
+  auto temp = sys::fs::TempFile::create(model);
+  if (!temp)
+    return consumeError(temp.takeError());
+  {
+    raw_fd_ostream os(temp->FD, false);
+    os << Obj.getBuffer();
+  }
+  if (auto err = temp->keep(path_of(key))) {
+    consumeError(std::move(err));
+    return;
+  }
+
+  // keeps the bound during long sessions too
+  {
+    std::lock_guard<std::mutex> lock(KeysMutex);
+    WrittenSincePrune += Obj.getBufferSize();
+    if (WrittenSincePrune < Policy.MaxSizeBytes / 10)
+      return;
+    WrittenSincePrune = 0;
+  }
+  std::lock_guard<std::mutex> lock(PruneMutex);
+  pruneCache(Dir, Policy);
+}
+
+// What the JIT compiles for: the host as detectHost sees it, with the
+// features sorted, as a host with the same CPU name may lack some (e.g. a
+// VM masking AVX-512), and the codegen level.
+static Expected<std::string> describe_target() {
+  auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB)
+    return JTMB.takeError();
+  std::vector<std::string> features = JTMB->getFeatures().getFeatures();
+  std::sort(features.begin(), features.end());
+
+  std::string target = JTMB->getTargetTriple().str() + " " + JTMB->getCPU();
+  for (auto &feature : features)
+    target += " " + feature;
+  target += std::format(" O{}", (int)orc::KaleidoscopeJIT::CachedOptLevel);
+  return target;
+}
+
+std::unique_ptr<ObjectCache> create_object_cache() {
+  if (CACHE_DIR.empty())
+    return nullptr;
+  if (auto err = sys::fs::create_directories(CACHE_DIR)) {
+    fprintf(stderr, "\rWarning: no object cache in %s: %s\n",
+            CACHE_DIR.c_str(), err.message().c_str());
+    return nullptr;
+  }
+
+  auto target = describe_target();
+  if (!target) {
+    fprintf(stderr, "\rWarning: no object cache: %s\n",
+            toString(target.takeError()).c_str());
+    return nullptr;
+  }
+
+  // only the size bounds the cache
+  CachePruningPolicy policy;
+  policy.Interval = std::chrono::seconds(0);
+  policy.Expiration = std::chrono::seconds(0);
+  policy.MaxSizePercentageOfAvailableSpace = 0;
+  policy.MaxSizeBytes = uint64_t(CACHE_SIZE) << 20;
+  pruneCache(CACHE_DIR, policy);
+  return std::make_unique<ObjectDiskCache>(CACHE_DIR, std::move(*target),
+                                           policy);
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace llvm;
+
+// Keeps the objects compiled by the JIT in KPP_CACHE_DIR, each under a hash
+// of the optimised IR and of the target, so that later sessions load them
+// instead of running codegen again. Tier 0 modules, whose counters are
+// addresses of this session, and top level expressions, which no session
+// compiles twice, never reach it.
+class ObjectDiskCache : public ObjectCache {
+  std::string Dir;
+  std::string Target; // hashed into every key, see describe_target
+  CachePruningPolicy Policy;
+  std::mutex KeysMutex;
+  // from getObject to notifyObjectCompiled, which the compilers call on the
+  // same module
+  std::map<const Module *, std::string> Keys;
+  uint64_t WrittenSincePrune = 0; // under KeysMutex
+  std::mutex PruneMutex;          // the workers may all fill the cache
+
+  std::string key_of(const Module &M) const;
+  std::string path_of(const std::string &key) const;
+
+public:
+  ObjectDiskCache(std::string dir, std::string target,
+                  CachePruningPolicy policy)
+      : Dir(std::move(dir)), Target(std::move(target)),
+        Policy(std::move(policy)) {}
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override;
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override;
+};
+
+// nullptr without KPP_CACHE_DIR. The directory is trimmed to KPP_CACHE_SIZE
+// megabytes first, dropping the objects used least recently, and again
+// whenever the session has written a tenth of that.
+std::unique_ptr<ObjectCache> create_object_cache();
+
+#endif
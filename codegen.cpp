@@ -1,20 +1,72 @@
 #include "ast.h"
 #include "debugger.h"
 #include "internal.h"
+#include "optimizer.h"
+#include "ssa.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/Casting.h"
-#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/IPO/FunctionAttrs.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <format>
 #include <memory>
+#include <optional>
+#include <utility>
+
+// Self tail calls of the function being generated jump back to Header with
+// the new arguments stored in Args instead of recursing.
+struct TailCallTarget {
+  std::string Name;
+  BasicBlock *Header = nullptr;
+  std::vector<LocalVariable *> Args;
+  LocalVariable *Accumulator = nullptr; // for `x + f(...)`/`x * f(...)`
+  std::string AccumulatorOp;
+};
+
+// `break`/`continue` targets of a loop whose body is being generated. The
+// blocks are created by the first jump needing them, and every jump brings
+// its value along with the block it comes from.
+using IncomingValues = std::vector<std::pair<Value *, BasicBlock *>>;
+struct LoopTarget {
+  std::string Name;
+  unsigned StackScopes; // of the `with` around the loop
+  BasicBlock *ContinueBB = nullptr, *BreakBB = nullptr;
+  IncomingValues Continues, Breaks;
+};
+
+// What a name refers to in the function being generated
+struct Symbol {
+  LocalVariable *Variable = nullptr;
+  RecordArray *Array = nullptr;
+};
+using SymbolScope = ScopedHashTableScope<StringRef, Symbol>;
+
+// State of the function being generated. A `for` or `with` opens a
+// SymbolScope, which drops its names again when the scope is left. The
+// names point into the AST and the LocalVariables, which both outlive it.
+struct FunctionContext {
+  ScopedHashTable<StringRef, Symbol> Symbols;
+  TailCallTarget *TailTarget = nullptr;
+  std::vector<LoopTarget *> LoopTargets;
+  // `with` scopes holding dynamically sized record arrays
+  unsigned StackScopes = 0;
+  bool WantsLoopPasses = false; // `for` hints or reductions
+};
+static FunctionContext *Fn = nullptr;
 
 Function *get_function(const std::string &name) {
   if (auto *f = TheModule->getFunction(name))
@@ -27,24 +79,166 @@ Function *get_function(const std::string &name) {
   return nullptr;
 }
 
+// Native operators other than the arithmetic ones may be redefined by the
+// user through the usual `binary`/`unary` definitions.
+static bool is_overridable_binary_op(const std::string &op) {
+  return op == "&&" || op == "||" || op == "==" || op == "!=" || op == "<=" ||
+         op == ">=" || op == "/" || op == "%" || op == "^";
+}
+
+static Function *get_user_operator(const std::string &name) {
+  if (FunctionProtos.find(name) == FunctionProtos.end())
+    return nullptr;
+  return get_function(name);
+}
+
+// Comparisons are unordered, so anything compared with NaN is true except
+// `==`, which keeps the `!(a < b | a > b)` semantics of the old library op.
+static std::optional<CmpInst::Predicate>
+get_comparison_predicate(const std::string &op) {
+  if (op == "<")
+    return CmpInst::FCMP_ULT;
+  if (op == ">")
+    return CmpInst::FCMP_UGT;
+  if (op == "<=")
+    return CmpInst::FCMP_ULE;
+  if (op == ">=")
+    return CmpInst::FCMP_UGE;
+  if (op == "==")
+    return CmpInst::FCMP_OEQ;
+  if (op == "!=")
+    return CmpInst::FCMP_UNE;
+  return std::nullopt;
+}
+
+// Division by a constant becomes a multiplication by its reciprocal when that
+// is exact (powers of two), or always under fast-math.
+static Value *codegen_division(Value *L, Value *R) {
+  if (auto *divisor = dyn_cast<ConstantFP>(R)) {
+    APFloat reciprocal(0.0);
+    if (divisor->getValueAPF().getExactInverse(&reciprocal))
+      return Builder->CreateFMul(L, ConstantFP::get(*TheContext, reciprocal),
+                                 "divtmp");
+
+    if (FAST_MATH && divisor->getValueAPF().isFiniteNonZero()) {
+      reciprocal = APFloat(1.0);
+      reciprocal.divide(divisor->getValueAPF(), APFloat::rmNearestTiesToEven);
+      return Builder->CreateFMul(L, ConstantFP::get(*TheContext, reciprocal),
+                                 "divtmp");
+    }
+  }
+  return Builder->CreateFDiv(L, R, "divtmp");
+}
+
+// Integer exponents up to this magnitude are expanded into multiplications
+#define MAX_EXPANDED_EXPONENT 64
+
+// x^n for a constant integer n, by square-and-multiply
+static Value *codegen_integer_power(Value *base, int64_t n) {
+  uint64_t e = n < 0 ? -n : n;
+  Value *result = nullptr;
+  Value *square = base;
+  while (e) {
+    if (e & 1)
+      result = result ? Builder->CreateFMul(result, square, "powtmp") : square;
+    e >>= 1;
+    if (e)
+      square = Builder->CreateFMul(square, square, "powsq");
+  }
+
+  auto *one = ConstantFP::get(*TheContext, APFloat(1.0));
+  if (!result)
+    return one;
+  if (n < 0)
+    return Builder->CreateFDiv(one, result, "powtmp");
+  return result;
+}
+
+static Value *codegen_power(Value *L, Value *R) {
+  auto *double_type = Type::getDoubleTy(*TheContext);
+
+  if (auto *exponent = dyn_cast<ConstantFP>(R)) {
+    double e = exponent->getValueAPF().convertToDouble();
+    // checked before any cast, which NaN, inf and huge values overflow
+    if (std::isfinite(e) && std::trunc(e) == e && std::fabs(e) <= INT32_MAX) {
+      if (std::fabs(e) <= MAX_EXPANDED_EXPONENT)
+        return codegen_integer_power(L, (int64_t)e);
+      return Builder->CreateIntrinsic(Intrinsic::powi,
+                                      {double_type, Builder->getInt32Ty()},
+                                      {L, Builder->getInt32((int32_t)e)},
+                                      nullptr, "powtmp");
+    }
+
+    // sqrt differs from pow for -0.0 and -inf
+    if (FAST_MATH && e == 0.5)
+      return Builder->CreateUnaryIntrinsic(Intrinsic::sqrt, L, nullptr,
+                                           "powtmp");
+  }
+  return Builder->CreateBinaryIntrinsic(Intrinsic::pow, L, R, nullptr,
+                                        "powtmp");
+}
+
+static bool is_boolean_op(const std::string &op) {
+  return op == "&&" || op == "||" || get_comparison_predicate(op);
+}
+
+// Speculation costs
+
+// Arms of an `if` (or the RHS of `&&`/`||`) costing at most this much in
+// total are evaluated unconditionally and combined with a select.
+#define SELECT_MAX_COST 8
+
+static unsigned add_costs(unsigned a, unsigned b) {
+  if (a == ExprAST::NOT_SPECULATABLE || b == ExprAST::NOT_SPECULATABLE)
+    return ExprAST::NOT_SPECULATABLE;
+  return a + b;
+}
+
+static bool should_speculate(unsigned cost) {
+  switch (IF_LOWERING) {
+  case IfLowering::Branch:
+    return false;
+  case IfLowering::Select:
+    return cost != ExprAST::NOT_SPECULATABLE;
+  case IfLowering::Auto:
+    break;
+  }
+  return cost <= SELECT_MAX_COST;
+}
+
+Value *ExprAST::codegen_cond() {
+  Value *val = codegen();
+  if (!val)
+    return nullptr;
+  return Builder->CreateFCmpONE(
+      val, ConstantFP::get(*TheContext, APFloat(0.0)), "tobool");
+}
+
 Value *NumberExprAST::codegen() {
   // DebugInfoInserter::emit_location(this);
   return ConstantFP::get(*TheContext, APFloat(Val));
 }
 
 Value *VariableExprAST::codegen() {
-  AllocaInst *A = NamedValues[Name];
-  if (!A)
+  LocalVariable *var = Fn->Symbols.lookup(Name).Variable;
+  if (!var)
     return log_error_v("Unknown variable name");
 
   // DebugInfoInserter::emit_location(this);
-  return Builder->CreateLoad(Type::getDoubleTy(*TheContext), A, Name.c_str());
+  return SSA.read(var);
 }
 
 Value *BinaryExprAST::codegen() {
 
   // assignment
   if (Op == "=") {
+    if (auto *field = dyn_cast<FieldExprAST>(LHS.get())) {
+      Value *val = RHS->codegen();
+      if (!val)
+        return nullptr;
+      return field->codegen_store(val);
+    }
+
     // We use LLVM-style RTTI so we can do error checking
     auto LHSE = dyn_cast<VariableExprAST>(LHS.get());
 
@@ -56,16 +250,36 @@ Value *BinaryExprAST::codegen() {
     if (!val)
       return nullptr;
 
-    auto *variable = NamedValues[LHSE->get_name()];
+    auto *variable = Fn->Symbols.lookup(LHSE->get_name()).Variable;
     if (!variable)
       return log_error_v(
           std::format("Variable {} does not exist.", LHSE->get_name()).c_str());
 
     DebugInfoInserter::emit_location(this);
-    Builder->CreateStore(val, variable);
+    SSA.write(variable, val);
     return val; // assignment returns value as C and C++
   }
 
+  if (Accumulates && Fn->TailTarget->Accumulator)
+    return codegen_accumulation();
+
+  if (Sequences)
+    return LHS->codegen() ? RHS->codegen() : nullptr;
+
+  // natives below `<`/`>` can be replaced with `def binary<op>`
+  Function *user_op = nullptr;
+  if (is_overridable_binary_op(Op))
+    user_op = get_user_operator(std::string("binary") + Op);
+
+  if (!user_op && is_boolean_op(Op)) {
+    Value *cond = codegen_cond();
+    if (!cond)
+      return nullptr;
+    // Convert bool 0/1 to double 0.0 or 1.0
+    return Builder->CreateUIToFP(cond, Type::getDoubleTy(*TheContext),
+                                 "booltmp");
+  }
+
   Value *L = LHS->codegen();
   Value *R = RHS->codegen();
   if (!L || !R)
@@ -73,23 +287,22 @@ Value *BinaryExprAST::codegen() {
 
   DebugInfoInserter::emit_location(this);
 
-  if (Op == "+")
-    return Builder->CreateFAdd(L, R, "addtmp");
-  if (Op == "-")
-    return Builder->CreateFSub(L, R, "subtmp");
-  if (Op == "*")
-    return Builder->CreateFMul(L, R, "multmp");
-  if (Op == "<") {
-    L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-  }
-  if (Op == ">") {
-    L = Builder->CreateFCmpULT(R, L, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+  if (!user_op) {
+    if (Op == "+")
+      return Builder->CreateFAdd(L, R, "addtmp");
+    if (Op == "-")
+      return Builder->CreateFSub(L, R, "subtmp");
+    if (Op == "*")
+      return Builder->CreateFMul(L, R, "multmp");
+    if (Op == "/")
+      return codegen_division(L, R);
+    if (Op == "%")
+      return Builder->CreateFRem(L, R, "remtmp");
+    if (Op == "^")
+      return codegen_power(L, R);
   }
 
-  auto *f = get_function(std::string("binary") + Op);
+  auto *f = user_op ? user_op : get_function(std::string("binary") + Op);
   if (!f)
     return log_error_v(
         std::format("Binary operator `{}` not found", Op).c_str());
@@ -98,18 +311,127 @@ Value *BinaryExprAST::codegen() {
   return Builder->CreateCall(f, Ops, "binop");
 }
 
+Value *BinaryExprAST::codegen_cond() {
+  if (!is_boolean_op(Op) ||
+      (is_overridable_binary_op(Op) &&
+       get_user_operator(std::string("binary") + Op)))
+    return ExprAST::codegen_cond();
+
+  if (Op == "&&" || Op == "||")
+    return codegen_short_circuit();
+
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+  return Builder->CreateFCmp(*get_comparison_predicate(Op), L, R, "cmptmp");
+}
+
+// acc = acc op x, then jump back like a plain self tail call
+Value *BinaryExprAST::codegen_accumulation() {
+  Value *x = AccumulatedOperand->codegen();
+  if (!x)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+
+  Value *acc = SSA.read(Fn->TailTarget->Accumulator);
+  acc = Op == "+" ? Builder->CreateFAdd(acc, x, "accadd")
+                  : Builder->CreateFMul(acc, x, "accmul");
+  SSA.write(Fn->TailTarget->Accumulator, acc);
+  return RecursiveCall->codegen();
+}
+
+// `&&` and `||` only evaluate RHS when LHS does not decide the result
+Value *BinaryExprAST::codegen_short_circuit() {
+  Value *l_bool = LHS->codegen_cond();
+  if (!l_bool)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+
+  bool is_and = Op == "&&";
+  if (should_speculate(RHS->speculation_cost())) {
+    Value *r_bool = RHS->codegen_cond();
+    if (!r_bool)
+      return nullptr;
+    return is_and ? Builder->CreateLogicalAnd(l_bool, r_bool, "logictmp")
+                  : Builder->CreateLogicalOr(l_bool, r_bool, "logictmp");
+  }
+
+  Function *f = Builder->GetInsertBlock()->getParent();
+  auto *lhs_bb = Builder->GetInsertBlock();
+  auto *rhs_bb = BasicBlock::Create(*TheContext, is_and ? "and.rhs" : "or.rhs");
+  auto *merge_bb =
+      BasicBlock::Create(*TheContext, is_and ? "and.end" : "or.end");
+
+  if (is_and)
+    Builder->CreateCondBr(l_bool, rhs_bb, merge_bb);
+  else
+    Builder->CreateCondBr(l_bool, merge_bb, rhs_bb);
+
+  f->insert(f->end(), rhs_bb);
+  SSA.seal(rhs_bb);
+  Builder->SetInsertPoint(rhs_bb);
+  Value *r_bool = RHS->codegen_cond();
+  if (!r_bool)
+    return nullptr;
+  Builder->CreateBr(merge_bb);
+  rhs_bb = Builder->GetInsertBlock();
+
+  f->insert(f->end(), merge_bb);
+  SSA.seal(merge_bb);
+  Builder->SetInsertPoint(merge_bb);
+  auto *result =
+      Builder->CreatePHI(Type::getInt1Ty(*TheContext), 2, "logictmp");
+  result->addIncoming(Builder->getInt1(!is_and), lhs_bb);
+  result->addIncoming(r_bool, rhs_bb);
+  return result;
+}
+
 Value *UnaryExprAST::codegen() {
-  auto *f = get_function(std::format("unary{}", Op));
-  if (!f)
+  auto *f = get_user_operator(std::format("unary{}", Op));
+  if (!f && Op != "!" && Op != "-")
     return log_error_v(
         std::format("Unary operator {} does not exist.", Op).c_str());
 
+  if (!f && Op == "!") {
+    Value *cond = codegen_cond();
+    if (!cond)
+      return nullptr;
+    return Builder->CreateUIToFP(cond, Type::getDoubleTy(*TheContext),
+                                 "booltmp");
+  }
+
   auto operand = Operand->codegen();
   if (!operand)
     return nullptr;
 
   DebugInfoInserter::emit_location(this);
-  return Builder->CreateCall(f, operand);
+  if (f)
+    return Builder->CreateCall(f, operand);
+
+  // `0-v`, as lib/core.kl defined it, so that -0 prints as 0. Only fast-math
+  // lets the sign of zero go, where fneg is cheaper.
+  if (FAST_MATH)
+    return Builder->CreateFNeg(operand, "negtmp");
+  return Builder->CreateFSub(ConstantFP::get(operand->getType(), 0.0),
+                             operand, "negtmp");
+}
+
+// `!` is true for 0.0 and NaN, exactly the values its operand is false for
+Value *UnaryExprAST::codegen_cond() {
+  if (Op != "!" || get_user_operator("unary!"))
+    return ExprAST::codegen_cond();
+
+  Value *operand = Operand->codegen_cond();
+  if (!operand)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+  return Builder->CreateNot(operand, "nottmp");
 }
 
 Value *CallExprAST::codegen() {
@@ -123,6 +445,9 @@ Value *CallExprAST::codegen() {
         std::format("Incorrect number of arguments for function {}", Callee)
             .c_str());
 
+  if (IsTail && Fn->TailTarget->Header && Callee == Fn->TailTarget->Name)
+    return codegen_self_tail_call();
+
   DebugInfoInserter::emit_location(this);
 
   std::vector<Value *> ArgsV;
@@ -131,7 +456,39 @@ Value *CallExprAST::codegen() {
     if (!ArgsV.back()) // if the last element is nullptr
       return nullptr;
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+
+  auto *call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  if (IsTail)
+    call->setTailCall();
+  else if (Callee == Fn->TailTarget->Name)
+    log_remark(get_line(), get_col(),
+               std::format("recursive call to {} is not in tail position, "
+                           "it stays a call",
+                           Callee));
+  return call;
+}
+
+Value *CallExprAST::codegen_self_tail_call() {
+  // all arguments are evaluated before any parameter is overwritten
+  std::vector<Value *> ArgsV;
+  for (auto &expr : Args) {
+    ArgsV.push_back(expr->codegen());
+    if (!ArgsV.back())
+      return nullptr;
+  }
+
+  DebugInfoInserter::emit_location(this);
+
+  for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+    SSA.write(Fn->TailTarget->Args[i], ArgsV[i]);
+  Builder->CreateBr(Fn->TailTarget->Header);
+
+  // Whatever uses the value of the call is unreachable now
+  Function *f = Builder->GetInsertBlock()->getParent();
+  auto *after_bb = BasicBlock::Create(*TheContext, "aftertail", f);
+  SSA.seal(after_bb);
+  Builder->SetInsertPoint(after_bb);
+  return PoisonValue::get(Type::getDoubleTy(*TheContext));
 }
 
 Function *PrototypeAST::codegen() {
@@ -146,81 +503,482 @@ Function *PrototypeAST::codegen() {
     std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
     FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
   }
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+  // an extern repeated in the same module, as lib/klpp.hkl repeats the
+  // operators of lib/core.hkl, redeclares the function instead of adding
+  // another one named `name.1`
+  Function *F = TheModule->getFunction(Name);
+  if (F && F->getFunctionType() != FT)
+    return (Function *)log_error_v(
+        std::format("Can not redeclare function {} which has {} arguments"
+                    " with {} arguments",
+                    Name, F->arg_size(), Args.size())
+            .c_str());
+  if (!F)
+    F = Function::Create(FT, Function::ExternalLinkage, Name,
+                         TheModule.get());
+  apply_to(F);
+
+  if (is_binary_op())
+    BINOP_PRECEDENCE[get_operator_name()] = get_binary_precedence();
+
+  return F;
+}
 
+void PrototypeAST::apply_to(Function *F) const {
   unsigned idx = 0;
   for (auto &arg : F->args())
     arg.setName(Args[idx++]);
 
-  if (is_binary_op())
-    BINOP_PRECEDENCE[get_operator_name()] = get_binary_precedence();
+  F->setAttributes(AttributeList());
+  if (Attributes & (Pure | ReadOnly)) {
+    F->setDoesNotThrow();
+    F->setWillReturn();
+  }
+  if (Attributes & Pure)
+    F->setDoesNotAccessMemory();
+  else if (Attributes & ReadOnly)
+    F->setOnlyReadsMemory();
+  if (Attributes & Inline)
+    F->addFnAttr(Attribute::AlwaysInline);
+  if (Attributes & NoInline)
+    F->addFnAttr(Attribute::NoInline);
+  if (Attributes & Hot)
+    F->addFnAttr(Attribute::Hot);
+  if (Attributes & Cold)
+    F->addFnAttr(Attribute::Cold);
+
+  if (InferredNoUnwind)
+    F->setDoesNotThrow();
+  F->setMemoryEffects(F->getMemoryEffects() & InferredMemory);
+}
 
-  return F;
+void PrototypeAST::record_inferred_attributes(const Function &F) {
+  InferredNoUnwind = F.doesNotThrow();
+  if (lends_inferred_memory())
+    InferredMemory = F.getMemoryEffects();
 }
 
-Function *FunctionAST::codegen() {
+// Lets callers skip a call whose body only returns its last argument, as
+// inlining it would. The same definitions as above may be relied on.
+void PrototypeAST::record_returned_argument(const Function &F) {
+  ReturnsLastArg = false;
+  if (!lends_inferred_memory() || F.isDeclaration() || F.arg_empty())
+    return;
+  auto *ret = dyn_cast<ReturnInst>(F.getEntryBlock().getFirstNonPHIOrDbg());
+  ReturnsLastArg = ret && ret->getReturnValue() == F.getArg(F.arg_size() - 1);
+}
 
-  auto &p = *Proto;
-  Function *F = get_function(Proto->get_name());
+// In the JIT, a redefinition may add side effects that callers compiled
+// against the inferred memory effects would not see. Only `inline`
+// definitions, whose bodies the callers copy anyway, lend them there
+// (`pure` and `readonly` declare theirs).
+bool PrototypeAST::lends_inferred_memory() const {
+#ifndef COMPILATION
+  return Attributes & Inline;
+#else
+  return true;
+#endif
+}
 
-  if (!F) {
-    FunctionProtos[p.get_name()] = std::move(Proto);
-    if (!(F = p.codegen()))
-      return nullptr;
+// Kaleidoscope code never unwinds, whatever a redefinition does, and the
+// memory effects of the optimised body only depend on the (already
+// annotated) declarations it calls. Both are kept on the prototype so that
+// the declarations get_function creates in other modules let callers CSE
+// and hoist calls to F.
+static void infer_attributes(Function &F, PrototypeAST &proto) {
+  F.setDoesNotThrow();
+
+  if (proto.lends_inferred_memory()) {
+    auto &AAR = TheFAM->getResult<AAManager>(F);
+    F.setMemoryEffects(F.getMemoryEffects() &
+                       computeFunctionBodyMemoryAccess(F, AAR));
   }
 
-  if (F->arg_size() != p.get_arg_size())
+  proto.record_inferred_attributes(F);
+}
+
+// KPP_OPT_LEVEL leaves the optimisation to the JIT workers. Otherwise the
+// loop passes only run on functions whose loops ask for them, as they cost
+// the REPL most of its latency; ahead of time they always run.
+static void run_function_passes(Function &F, bool wants_loop_passes) {
+#ifndef COMPILATION
+  if (OPT_LEVEL >= 0)
+    return;
+#else
+  wants_loop_passes = true;
+#endif
+  TheFPM->run(F, *TheFAM);
+  if (wants_loop_passes)
+    TheLoopFPM->run(F, *TheFAM);
+}
+
+Function *FunctionAST::codegen() {
+
+  auto &p = *Proto;
+  Function *F = get_function(p.get_name());
+
+  if (F && F->arg_size() != p.get_arg_size())
     return (Function *)log_error_v(
         std::format("Can not overwrite function {} which has {} arguments"
                     " with a function which has {} arguments",
-                    Proto->get_name(), F->arg_size(), Proto->get_arg_size())
+                    p.get_name(), F->arg_size(), p.get_arg_size())
             .c_str());
 
+  // The definition's prototype (and so its annotations) replaces whatever
+  // extern or earlier definition declared the function. All of it is put
+  // back if the body fails, leaving the previous definition in use.
+  std::string name = p.get_name();
+  bool is_binary_op = p.is_binary_op();
+  AttributeList previous_attributes;
+  std::map<std::string, int> previous_precedences;
+  if (is_binary_op)
+    previous_precedences = BINOP_PRECEDENCE;
+  if (F) {
+    previous_attributes = F->getAttributes();
+    p.apply_to(F);
+  } else if (!(F = p.codegen()))
+    return nullptr;
+  p.set_has_body();
+  auto previous_proto = std::exchange(FunctionProtos[name], std::move(Proto));
+
+  // Accumulating recursion reassociates the operations, so it is only turned
+  // into a loop under fast-math, and only if every site uses the same op.
+  TailCallScan scan{p.get_name()};
+  Body->mark_tail_calls(scan);
+  std::string accumulator_op;
+  for (auto *site : scan.Accumulations) {
+    if (!FAST_MATH)
+      log_remark(site->get_line(), site->get_col(),
+                 std::format("recursion accumulating with `{}` needs "
+                             "KPP_FAST_MATH=1 to become a loop",
+                             site->get_op()));
+    else if (accumulator_op.empty() || accumulator_op == site->get_op())
+      accumulator_op = site->get_op();
+    else {
+      log_remark(site->get_line(), site->get_col(),
+                 "recursion accumulates with both `+` and `*`, it can not "
+                 "become a loop");
+      accumulator_op = "";
+      break;
+    }
+  }
+  if (!accumulator_op.empty())
+    for (auto *site : scan.Accumulations)
+      site->enable_accumulation();
+
   BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
   Builder->SetInsertPoint(BB);
   DebugInfoInserter DII;
+  SSA.reset();
+  SSA.seal(BB);
 
   DII.insert_subprogram(p.get_line(), F);
-  // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
+  // Record the function arguments in the outermost scope.
+  FunctionContext context;
+  SymbolScope arguments(context.Symbols);
+  TailCallTarget tail_target{p.get_name()};
   for (auto &arg : F->args()) {
-    AllocaInst *arg_alloca = create_entry_block_alloca(F, arg.getName());
-    DII.insert_function_parameter(p.get_line(), arg, arg_alloca);
-    Builder->CreateStore(&arg, arg_alloca);
-    NamedValues[std::string(arg.getName())] = arg_alloca;
+    LocalVariable *arg_var = SSA.create(F, arg.getName());
+    DII.insert_function_parameter(p.get_line(), arg, arg_var->Alloca);
+    SSA.write(arg_var, &arg);
+    context.Symbols.insert(arg_var->Name, {arg_var});
+    tail_target.Args.push_back(arg_var);
+  }
+
+  if (!scan.SelfCalls.empty() || !accumulator_op.empty()) {
+    if (!accumulator_op.empty()) {
+      tail_target.Accumulator = SSA.create(F, "accumulator");
+      tail_target.AccumulatorOp = accumulator_op;
+      double identity = accumulator_op == "+" ? 0.0 : 1.0;
+      SSA.write(tail_target.Accumulator,
+                ConstantFP::get(*TheContext, APFloat(identity)));
+    }
+    tail_target.Header = BasicBlock::Create(*TheContext, "tailrecurse", F);
+    Builder->CreateBr(tail_target.Header);
+    Builder->SetInsertPoint(tail_target.Header);
   }
+  context.TailTarget = &tail_target;
+  Fn = &context;
 
   // DII.emit_location(Body.get());
-  if (Value *ret_value = Body->codegen()) {
+  Value *ret_value = Body->codegen();
+  Fn = nullptr;
+  if (ret_value) {
+
+    if (tail_target.Accumulator) {
+      Value *acc = SSA.read(tail_target.Accumulator);
+      ret_value = tail_target.AccumulatorOp == "+"
+                      ? Builder->CreateFAdd(acc, ret_value, "accadd")
+                      : Builder->CreateFMul(acc, ret_value, "accmul");
+    }
+
+    // A tail call returned as is can be guaranteed when the signatures match
+    auto *call = dyn_cast<CallInst>(ret_value);
+    if (call && call->isTailCall() && F->getName() != "main" &&
+        &Builder->GetInsertBlock()->back() == call &&
+        call->getFunctionType() == F->getFunctionType())
+      call->setTailCallKind(CallInst::TCK_MustTail);
 
     if (F->getName() == "main")
       Builder->CreateRet(ConstantInt::get(*TheContext, APInt(32, 0, true)));
     else
       Builder->CreateRet(ret_value);
 
+    SSA.seal_all(*F);
     verifyFunction(*F);
-    if (!DEBUG)
-      TheFPM->run(*F, *TheFAM);
+    p.record_returned_argument(*F);
+    if (!DEBUG) {
+      // tier 0 of KPP_TIERED is compiled as generated
+      if (!TIERED) {
+#ifndef COMPILATION
+        inline_saved_callees(*F);
+#endif
+        run_function_passes(*F, context.WantsLoopPasses);
+        infer_attributes(*F, p);
+      }
+#ifndef COMPILATION
+      save_function_ir(*F);
+#endif
+    }
 
     return F;
   }
   DII.reset_scope();
-  F->eraseFromParent();
+  // calls generated earlier into the same module keep the declaration
+  if (F->use_empty()) {
+    F->eraseFromParent();
+  } else {
+    F->deleteBody();
+    F->setAttributes(previous_attributes);
+  }
+  if (previous_proto)
+    FunctionProtos[name] = std::move(previous_proto);
+  else
+    FunctionProtos.erase(name);
+  if (is_binary_op)
+    BINOP_PRECEDENCE = std::move(previous_precedences);
   return nullptr;
 }
 
+unsigned NumberExprAST::speculation_cost() const { return 0; }
+
+unsigned VariableExprAST::speculation_cost() const { return 1; }
+
+unsigned BinaryExprAST::speculation_cost() const {
+  if (Op == "=" || (is_overridable_binary_op(Op) &&
+                    get_user_operator(std::string("binary") + Op)))
+    return NOT_SPECULATABLE;
+
+  unsigned cost;
+  if (Op == "+" || Op == "-" || Op == "*" || is_boolean_op(Op))
+    cost = 1;
+  else if (Op == "/" || Op == "%")
+    cost = 4;
+  else if (Op == "^")
+    cost = isa<NumberExprAST>(RHS.get()) ? 4 : 16;
+  else // user-defined operators are calls
+    return NOT_SPECULATABLE;
+
+  return add_costs(cost, add_costs(LHS->speculation_cost(),
+                                   RHS->speculation_cost()));
+}
+
+unsigned UnaryExprAST::speculation_cost() const {
+  if ((Op != "!" && Op != "-") || get_user_operator("unary" + Op))
+    return NOT_SPECULATABLE;
+  return add_costs(1, Operand->speculation_cost());
+}
+
+// Only calls to `pure` externs can be evaluated speculatively. A `pure`
+// definition may recurse (directly or not) through the speculated call.
+unsigned CallExprAST::speculation_cost() const {
+  auto proto = FunctionProtos.find(Callee);
+  if (proto == FunctionProtos.end() || proto->second->has_body() ||
+      !(proto->second->get_attributes() & PrototypeAST::Pure))
+    return NOT_SPECULATABLE;
+
+  unsigned cost = 8;
+  for (auto &arg : Args)
+    cost = add_costs(cost, arg->speculation_cost());
+  return cost;
+}
+
+unsigned IfExprAST::speculation_cost() const {
+  return add_costs(
+      1, add_costs(Condition->speculation_cost(),
+                   add_costs(Then->speculation_cost(),
+                             Else->speculation_cost())));
+}
+
+// Tail positions
+
+void CallExprAST::mark_tail_calls(TailCallScan &scan) {
+  IsTail = true;
+  if (Callee == scan.Function)
+    scan.SelfCalls.push_back(this);
+}
+
+void BinaryExprAST::mark_tail_calls(TailCallScan &scan) {
+  // `printd(n) : f(n - 1)` returns the RHS of `:` without calling it
+  if (Op == ":") {
+    auto proto = FunctionProtos.find("binary:");
+    if (proto != FunctionProtos.end() && proto->second->returns_last_arg()) {
+      Sequences = true;
+      RHS->mark_tail_calls(scan);
+    }
+    return;
+  }
+
+  if (Op != "+" && Op != "*")
+    return;
+
+  // the other operand is evaluated before the recursion instead of after it
+  auto is_self_call = [&](ExprAST *E) {
+    auto *call = dyn_cast<CallExprAST>(E);
+    return call && call->get_callee() == scan.Function;
+  };
+  if (is_self_call(RHS.get()) && LHS->speculation_cost() != NOT_SPECULATABLE) {
+    RecursiveCall = cast<CallExprAST>(RHS.get());
+    AccumulatedOperand = LHS.get();
+  } else if (is_self_call(LHS.get()) &&
+             RHS->speculation_cost() != NOT_SPECULATABLE) {
+    RecursiveCall = cast<CallExprAST>(LHS.get());
+    AccumulatedOperand = RHS.get();
+  } else
+    return;
+
+  scan.Accumulations.push_back(this);
+}
+
+void BinaryExprAST::enable_accumulation() {
+  TailCallScan ignored;
+  RecursiveCall->mark_tail_calls(ignored);
+  Accumulates = true;
+}
+
+void IfExprAST::mark_tail_calls(TailCallScan &scan) {
+  // both arms are evaluated before the select, so neither is a tail position
+  if (is_speculated())
+    return;
+  Then->mark_tail_calls(scan);
+  Else->mark_tail_calls(scan);
+}
+
+void MatchExprAST::mark_tail_calls(TailCallScan &scan) {
+  for (auto &arm : Arms)
+    arm.Body->mark_tail_calls(scan);
+  if (Else)
+    Else->mark_tail_calls(scan);
+}
+
+void WithExprAST::mark_tail_calls(TailCallScan &scan) {
+  // jumping out of the body would skip releasing dynamic record arrays
+  for (auto &variable : Variables) {
+    auto *array = dyn_cast_or_null<RecordArrayExprAST>(variable.second.get());
+    if (array && !array->is_static())
+      return;
+  }
+  Body->mark_tail_calls(scan);
+}
+
+// Variable uses
+
+void VariableExprAST::collect_variables(VariableUses &uses) const {
+  uses.Read.insert(Name);
+}
+
+void BinaryExprAST::collect_variables(VariableUses &uses) const {
+  if (auto *var = dyn_cast<VariableExprAST>(LHS.get()); var && Op == "=")
+    uses.Assigned.insert(var->get_name());
+  else
+    LHS->collect_variables(uses);
+  RHS->collect_variables(uses);
+}
+
+void UnaryExprAST::collect_variables(VariableUses &uses) const {
+  Operand->collect_variables(uses);
+}
+
+void CallExprAST::collect_variables(VariableUses &uses) const {
+  for (auto &arg : Args)
+    arg->collect_variables(uses);
+}
+
+void IfExprAST::collect_variables(VariableUses &uses) const {
+  Condition->collect_variables(uses);
+  Then->collect_variables(uses);
+  Else->collect_variables(uses);
+}
+
+void ForExprAST::collect_variables(VariableUses &uses) const {
+  uses.Assigned.insert(VarName);
+  Start->collect_variables(uses);
+  Condition->collect_variables(uses);
+  Step->collect_variables(uses);
+  Body->collect_variables(uses);
+}
+
+void WhileExprAST::collect_variables(VariableUses &uses) const {
+  Condition->collect_variables(uses);
+  Body->collect_variables(uses);
+}
+
+void BreakExprAST::collect_variables(VariableUses &uses) const {
+  if (Val)
+    Val->collect_variables(uses);
+}
+
+void ContinueExprAST::collect_variables(VariableUses &uses) const {
+  if (Val)
+    Val->collect_variables(uses);
+}
+
+void MatchExprAST::collect_variables(VariableUses &uses) const {
+  Key->collect_variables(uses);
+  for (auto &arm : Arms)
+    arm.Body->collect_variables(uses);
+  if (Else)
+    Else->collect_variables(uses);
+}
+
+void WithExprAST::collect_variables(VariableUses &uses) const {
+  for (auto &variable : Variables) {
+    uses.Assigned.insert(variable.first);
+    if (variable.second)
+      variable.second->collect_variables(uses);
+  }
+  Body->collect_variables(uses);
+}
+
+void RecordArrayExprAST::collect_variables(VariableUses &uses) const {
+  Count->collect_variables(uses);
+}
+
+void FieldExprAST::collect_variables(VariableUses &uses) const {
+  uses.Read.insert(ArrayName);
+  Index->collect_variables(uses);
+}
+
+bool IfExprAST::is_speculated() const {
+  return should_speculate(
+      add_costs(Then->speculation_cost(), Else->speculation_cost()));
+}
+
 Value *IfExprAST::codegen() {
 
   DebugInfoInserter::emit_location(this);
 
-  Value *cond_val = Condition->codegen();
-
-  if (!cond_val)
+  Value *bool_cond = Condition->codegen_cond();
+  if (!bool_cond)
     return nullptr;
 
-  auto *bool_cond = Builder->CreateFCmpONE(
-      cond_val, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+  if (is_speculated()) {
+    Value *then_val = Then->codegen();
+    Value *else_val = Else->codegen();
+    if (!then_val || !else_val)
+      return nullptr;
+    return Builder->CreateSelect(bool_cond, then_val, else_val, "iftmp");
+  }
 
   Function *f = Builder->GetInsertBlock()->getParent();
 
@@ -229,6 +987,8 @@ Value *IfExprAST::codegen() {
   auto *fin_bb = BasicBlock::Create(*TheContext, "finish");
 
   Builder->CreateCondBr(bool_cond, then_bb, else_bb);
+  SSA.seal(then_bb);
+  SSA.seal(else_bb);
 
   Builder->SetInsertPoint(then_bb);
   Value *then_val = Then->codegen();
@@ -247,6 +1007,7 @@ Value *IfExprAST::codegen() {
   auto *else_phi_bb = Builder->GetInsertBlock();
 
   f->insert(f->end(), fin_bb);
+  SSA.seal(fin_bb);
   Builder->SetInsertPoint(fin_bb);
   auto *ret_val =
       Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
@@ -256,10 +1017,416 @@ Value *IfExprAST::codegen() {
   return ret_val;
 }
 
+// Loop exits
+
+static PHINode *join_values(IncomingValues &values, const std::string &name) {
+  auto *phi = Builder->CreatePHI(Type::getDoubleTy(*TheContext),
+                                 values.size(), name);
+  for (auto &[value, block] : values)
+    phi->addIncoming(value, block);
+  return phi;
+}
+
+// Ends the body of an iteration valued `value`. The `continue`s meet it in
+// the continue block, where the latch starts.
+static Value *join_continues(LoopTarget &target, Value *value) {
+  if (!target.ContinueBB)
+    return value;
+
+  target.Continues.emplace_back(value, Builder->GetInsertBlock());
+  Builder->CreateBr(target.ContinueBB);
+
+  auto *f = Builder->GetInsertBlock()->getParent();
+  f->insert(f->end(), target.ContinueBB);
+  SSA.seal(target.ContinueBB);
+  Builder->SetInsertPoint(target.ContinueBB);
+  return join_values(target.Continues, target.Name + "-continuevalue");
+}
+
+// Starts the block the `break`s jump to, and returns their value (nullptr
+// when there is no `break`).
+static Value *join_breaks(LoopTarget &target) {
+  if (!target.BreakBB)
+    return nullptr;
+
+  auto *f = Builder->GetInsertBlock()->getParent();
+  f->insert(f->end(), target.BreakBB);
+  SSA.seal(target.BreakBB);
+  Builder->SetInsertPoint(target.BreakBB);
+  return join_values(target.Breaks, target.Name + "-breakvalue");
+}
+
+// Value of a loop ending in the current block: the `break` value when coming
+// from `break_bb` and 0.0 otherwise
+static Value *loop_result(Value *break_value, BasicBlock *break_bb) {
+  auto *zero = ConstantFP::get(*TheContext, APFloat(0.0));
+  if (!break_value)
+    return zero;
+
+  auto *end_bb = Builder->GetInsertBlock();
+  auto *phi = Builder->CreatePHI(Type::getDoubleTy(*TheContext),
+                                 pred_size(end_bb), "loopvalue");
+  for (auto *pred : predecessors(end_bb))
+    phi->addIncoming(pred == break_bb ? break_value : zero, pred);
+  return phi;
+}
+
+static Value *codegen_loop_jump(ExprAST *jump, ExprAST *value_expr,
+                                bool is_break) {
+  const char *keyword = is_break ? "break" : "continue";
+  if (Fn->LoopTargets.empty())
+    return log_error_v(std::format("`{}` outside of a loop.", keyword).c_str());
+
+  auto &target = *Fn->LoopTargets.back();
+  if (target.StackScopes != Fn->StackScopes)
+    return log_error_v(
+        std::format("`{}` can not leave a `with` holding a dynamically sized "
+                    "record array.",
+                    keyword)
+            .c_str());
+
+  Value *value = value_expr ? value_expr->codegen()
+                            : ConstantFP::get(*TheContext, APFloat(0.0));
+  if (!value)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(jump);
+
+  auto *&block = is_break ? target.BreakBB : target.ContinueBB;
+  if (!block)
+    block = BasicBlock::Create(*TheContext,
+                               std::format("{}-{}", target.Name, keyword));
+  (is_break ? target.Breaks : target.Continues)
+      .emplace_back(value, Builder->GetInsertBlock());
+  Builder->CreateBr(block);
+
+  // Whatever uses the value of the jump is unreachable now
+  Function *f = Builder->GetInsertBlock()->getParent();
+  auto *after_bb =
+      BasicBlock::Create(*TheContext, std::format("after{}", keyword), f);
+  SSA.seal(after_bb);
+  Builder->SetInsertPoint(after_bb);
+  return PoisonValue::get(Type::getDoubleTy(*TheContext));
+}
+
+Value *BreakExprAST::codegen() {
+  return codegen_loop_jump(this, Val.get(), true);
+}
+
+Value *ContinueExprAST::codegen() {
+  return codegen_loop_jump(this, Val.get(), false);
+}
+
+Value *WhileExprAST::codegen() {
+  auto *f = Builder->GetInsertBlock()->getParent();
+
+  DebugInfoInserter::emit_location(this);
+
+  auto *loop_bb = BasicBlock::Create(*TheContext, "while-loop", f);
+  auto *body_bb = BasicBlock::Create(*TheContext, "while-body");
+  auto *end_bb = BasicBlock::Create(*TheContext, "while-end");
+
+  Builder->CreateBr(loop_bb);
+  Builder->SetInsertPoint(loop_bb);
+
+  Value *bool_cond = Condition->codegen_cond();
+  if (!bool_cond)
+    return nullptr;
+  Builder->CreateCondBr(bool_cond, body_bb, end_bb);
+
+  f->insert(f->end(), body_bb);
+  SSA.seal(body_bb);
+  Builder->SetInsertPoint(body_bb);
+
+  LoopTarget target{"while", Fn->StackScopes};
+  Fn->LoopTargets.push_back(&target);
+  Value *body = Body->codegen();
+  Fn->LoopTargets.pop_back();
+  if (!body)
+    return nullptr;
+
+  join_continues(target, body);
+  Builder->CreateBr(loop_bb);
+  SSA.seal(loop_bb);
+
+  Value *break_value = join_breaks(target);
+  auto *break_bb = Builder->GetInsertBlock();
+  if (break_value)
+    Builder->CreateBr(end_bb);
+
+  f->insert(f->end(), end_bb);
+  SSA.seal(end_bb);
+  Builder->SetInsertPoint(end_bb);
+  return loop_result(break_value, break_bb);
+}
+
+// `for` hints as llvm.loop metadata on the backedge:
+//   unroll 1       llvm.loop.unroll.disable
+//   unroll n       llvm.loop.unroll.count n
+//   vectorize 1    llvm.loop.vectorize.width 1 (disables it)
+//   vectorize n    llvm.loop.vectorize.enable, llvm.loop.vectorize.width n
+//   interleave n   llvm.loop.interleave.count n
+static void attach_loop_hints(Instruction *backedge, const LoopHints &hints) {
+  if (!hints.Unroll && !hints.Vectorize && !hints.Interleave)
+    return;
+  Fn->WantsLoopPasses = true;
+
+  SmallVector<Metadata *, 4> properties = {nullptr}; // the loop id itself
+  auto add = [&](StringRef name, std::optional<unsigned> count = {}) {
+    SmallVector<Metadata *, 2> property = {MDString::get(*TheContext, name)};
+    if (count)
+      property.push_back(ConstantAsMetadata::get(
+          ConstantInt::get(Type::getInt32Ty(*TheContext), *count)));
+    properties.push_back(MDNode::get(*TheContext, property));
+  };
+
+  if (hints.Unroll == 1)
+    add("llvm.loop.unroll.disable");
+  else if (hints.Unroll)
+    add("llvm.loop.unroll.count", hints.Unroll);
+  if (hints.Vectorize > 1)
+    properties.push_back(MDNode::get(
+        *TheContext, {MDString::get(*TheContext, "llvm.loop.vectorize.enable"),
+                      ConstantAsMetadata::get(Builder->getTrue())}));
+  if (hints.Vectorize)
+    add("llvm.loop.vectorize.width", hints.Vectorize);
+  if (hints.Interleave)
+    add("llvm.loop.interleave.count", hints.Interleave);
+
+  auto *loop_id = MDNode::getDistinct(*TheContext, properties);
+  loop_id->replaceOperandWith(0, loop_id);
+  backedge->setMetadata(LLVMContext::MD_loop, loop_id);
+}
+
+// Reductions
+
+LocalVariable *ForExprAST::codegen_reduction_start() {
+  if (Reduction.empty())
+    return nullptr;
+
+  double identity = Reduction == "sum"    ? 0.0
+                    : Reduction == "prod" ? 1.0
+                    : Reduction == "min"  ? HUGE_VAL
+                                          : -HUGE_VAL;
+  Fn->WantsLoopPasses = true; // reductions are there to be vectorised
+  auto *accumulator =
+      SSA.create(Builder->GetInsertBlock()->getParent(), Reduction);
+  SSA.write(accumulator, ConstantFP::get(*TheContext, APFloat(identity)));
+  return accumulator;
+}
+
+// A reduction leaves the order of its operations unspecified, which is what
+// lets the loop be vectorised: the partial results may be reassociated and
+// the sign of a zero result is not significant.
+void ForExprAST::codegen_reduction_step(LocalVariable *accumulator,
+                                        Value *value) {
+  if (!accumulator)
+    return;
+
+  IRBuilderBase::FastMathFlagGuard guard(*Builder);
+  FastMathFlags flags = Builder->getFastMathFlags();
+  flags.setAllowReassoc();
+  flags.setNoSignedZeros();
+  Builder->setFastMathFlags(flags);
+
+  Value *partial = SSA.read(accumulator);
+  if (Reduction == "sum")
+    partial = Builder->CreateFAdd(partial, value, Reduction);
+  else if (Reduction == "prod")
+    partial = Builder->CreateFMul(partial, value, Reduction);
+  else if (Reduction == "min") // NaN iterations are skipped
+    partial = Builder->CreateMinNum(partial, value, Reduction);
+  else
+    partial = Builder->CreateMaxNum(partial, value, Reduction);
+  SSA.write(accumulator, partial);
+}
+
+// Leaves the loop to end_bb, through the `break`s if any. A `break` value is
+// folded into a reduction as the value of the last iteration.
+Value *ForExprAST::codegen_exit(LocalVariable *accumulator,
+                                LoopTarget &target, BasicBlock *end_bb) {
+  auto *f = Builder->GetInsertBlock()->getParent();
+  Value *break_value = join_breaks(target);
+  if (break_value) {
+    codegen_reduction_step(accumulator, break_value);
+    Builder->CreateBr(end_bb);
+  }
+  auto *break_bb = Builder->GetInsertBlock();
+
+  f->insert(f->end(), end_bb);
+  SSA.seal(end_bb);
+  Builder->SetInsertPoint(end_bb);
+  if (!accumulator)
+    return loop_result(break_value, break_bb);
+  return SSA.read(accumulator);
+}
+
+// `n` in `n`, `-n`
+static std::optional<double> get_constant(ExprAST *E) {
+  if (auto *number = dyn_cast<NumberExprAST>(E))
+    return number->get_value();
+  if (auto *unary = dyn_cast<UnaryExprAST>(E);
+      unary && unary->get_op() == "-" &&
+      unary->speculation_cost() != ExprAST::NOT_SPECULATABLE)
+    if (auto value = get_constant(unary->get_operand()))
+      return -*value;
+  return std::nullopt;
+}
+
+// The loop runs a number of times known before it starts when the condition
+// compares the variable with a bound (`<`, `<=`, `>`, `>=`), and neither the
+// bound nor the step change in the loop. Without fast-math the variable has
+// to take exact integer values: an integer start and a constant integer step
+// moving towards the bound.
+bool ForExprAST::get_counted_bound(ExprAST *&bound, std::string &op) const {
+  auto *cmp = dyn_cast<BinaryExprAST>(Condition.get());
+  if (!cmp || cmp->speculation_cost() == NOT_SPECULATABLE ||
+      Step->speculation_cost() == NOT_SPECULATABLE)
+    return false;
+
+  op = cmp->get_op();
+  if (op != "<" && op != "<=" && op != ">" && op != ">=")
+    return false;
+
+  auto is_var = [&](ExprAST *E) {
+    auto *var = dyn_cast<VariableExprAST>(E);
+    return var && var->get_name() == VarName;
+  };
+  if (is_var(cmp->get_lhs()))
+    bound = cmp->get_rhs();
+  else if (is_var(cmp->get_rhs())) {
+    bound = cmp->get_lhs();
+    op = op[0] == '<' ? ">" + op.substr(1) : "<" + op.substr(1);
+  } else
+    return false;
+
+  VariableUses loop, invariant;
+  Body->collect_variables(loop);
+  Step->collect_variables(loop);
+  bound->collect_variables(invariant);
+  Step->collect_variables(invariant);
+  if (loop.Assigned.count(VarName) || invariant.Read.count(VarName))
+    return false;
+  for (auto &name : invariant.Read)
+    if (loop.Assigned.count(name))
+      return false;
+
+  auto step = get_constant(Step.get());
+  if (step && (*step == 0 || (*step > 0) != (op[0] == '<')))
+    return false;
+  if (FAST_MATH)
+    return true;
+
+  // below 2^53 every integer is a double, so the steps are exact
+  constexpr double EXACT_LIMIT = 9007199254740992.0;
+  auto start = get_constant(Start.get());
+  return start && step && std::trunc(*start) == *start &&
+         std::trunc(*step) == *step && std::fabs(*start) < EXACT_LIMIT &&
+         std::fabs(*step) < EXACT_LIMIT;
+}
+
+// Rotated loop with an i64 counter running up to a trip count computed in
+// the preheader:
+//
+//   preheader: n = trip count; br n > 0, body, end
+//   body:      var = start + i * step; ...; i += 1; br i != n, body, exit
+//   exit:      br end
+//
+// The variable is derived from the counter rather than carried as an fadd
+// recurrence, which the vectoriser only reorders under fast-math. With the
+// integer start and step get_counted_bound asks for, both are exact.
+Value *ForExprAST::codegen_counted(ExprAST *bound, const std::string &op) {
+  auto *f = Builder->GetInsertBlock()->getParent();
+  LocalVariable *var = SSA.create(f, VarName);
+
+  DebugInfoInserter::emit_location(this);
+
+  Value *start = Start->codegen();
+  if (!start)
+    return nullptr;
+
+  // the bound and the step do not see the loop variable
+  Value *limit = bound->codegen();
+  if (!limit)
+    return nullptr;
+  Value *step = Step->codegen();
+  if (!step)
+    return nullptr;
+
+  // `<`/`>` run ceil((bound - start) / step) times, `<=`/`>=` one more when
+  // the bound is reached exactly; a NaN bound saturates to 0 trips
+  auto *double_type = Type::getDoubleTy(*TheContext);
+  auto *i64 = Type::getInt64Ty(*TheContext);
+  Value *trips = Builder->CreateFDiv(Builder->CreateFSub(limit, start), step);
+  if (op.size() == 1)
+    trips = Builder->CreateUnaryIntrinsic(Intrinsic::ceil, trips);
+  else
+    trips = Builder->CreateFAdd(
+        Builder->CreateUnaryIntrinsic(Intrinsic::floor, trips),
+        ConstantFP::get(double_type, 1.0));
+  trips = Builder->CreateIntrinsic(Intrinsic::fptosi_sat, {i64, double_type},
+                                   {trips}, nullptr,
+                                   std::format("{}-trips", VarName));
+  LocalVariable *accumulator = codegen_reduction_start();
+
+  auto *preheader_bb = Builder->GetInsertBlock();
+  auto *loop_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-loop", VarName), f);
+  auto *exit_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-exit", VarName));
+  auto *end_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-endfor", VarName));
+
+  Builder->CreateCondBr(
+      Builder->CreateICmpSGT(trips, ConstantInt::get(i64, 0)), loop_bb,
+      end_bb);
+
+  Builder->SetInsertPoint(loop_bb);
+  auto *counter =
+      Builder->CreatePHI(i64, 2, std::format("{}-counter", VarName));
+  counter->addIncoming(ConstantInt::get(i64, 0), preheader_bb);
+  SSA.write(var, Builder->CreateFAdd(
+                     start,
+                     Builder->CreateFMul(
+                         Builder->CreateSIToFP(counter, double_type), step),
+                     VarName));
+
+  SymbolScope scope(Fn->Symbols);
+  Fn->Symbols.insert(VarName, {var});
+
+  LoopTarget target{VarName, Fn->StackScopes};
+  Fn->LoopTargets.push_back(&target);
+  Value *body = Body->codegen();
+  Fn->LoopTargets.pop_back();
+  if (!body)
+    return nullptr;
+  codegen_reduction_step(accumulator, join_continues(target, body));
+
+  auto *next = Builder->CreateAdd(counter, ConstantInt::get(i64, 1),
+                                  std::format("{}-nextcounter", VarName),
+                                  /*HasNUW=*/true, /*HasNSW=*/true);
+  counter->addIncoming(next, Builder->GetInsertBlock());
+  attach_loop_hints(Builder->CreateCondBr(Builder->CreateICmpNE(next, trips),
+                                          loop_bb, exit_bb),
+                    Hints);
+  SSA.seal(loop_bb);
+
+  f->insert(f->end(), exit_bb);
+  SSA.seal(exit_bb);
+  Builder->SetInsertPoint(exit_bb);
+  Builder->CreateBr(end_bb);
+
+  return codegen_exit(accumulator, target, end_bb);
+}
+
 Value *ForExprAST::codegen() {
+  ExprAST *bound;
+  std::string op;
+  if (get_counted_bound(bound, op))
+    return codegen_counted(bound, op);
 
-  AllocaInst *var_alloc = create_entry_block_alloca(
-      Builder->GetInsertBlock()->getParent(), VarName);
+  LocalVariable *var =
+      SSA.create(Builder->GetInsertBlock()->getParent(), VarName);
 
   DebugInfoInserter::emit_location(this);
 
@@ -267,11 +1434,14 @@ Value *ForExprAST::codegen() {
   if (!start)
     return nullptr;
 
-  Builder->CreateStore(start, var_alloc);
+  SSA.write(var, start);
+  LocalVariable *accumulator = codegen_reduction_start();
 
   auto *f = Builder->GetInsertBlock()->getParent();
   auto *loop_bb =
       BasicBlock::Create(*TheContext, std::format("{}-loop", VarName), f);
+  auto *body_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-body", VarName));
   auto *end_bb =
       BasicBlock::Create(*TheContext, std::format("{}-endfor", VarName));
 
@@ -279,47 +1449,207 @@ Value *ForExprAST::codegen() {
 
   Builder->SetInsertPoint(loop_bb);
 
-  auto *old_pointer = NamedValues[VarName];
-  NamedValues[VarName] = var_alloc;
+  SymbolScope scope(Fn->Symbols);
+  Fn->Symbols.insert(VarName, {var});
 
-  Value *condition = Condition->codegen();
-  if (!condition)
+  // Check the condition even on the first iteration
+  Value *bool_cond = Condition->codegen_cond();
+  if (!bool_cond)
     return nullptr;
-  auto *bool_cond = Builder->CreateFCmpONE(
-      condition, ConstantFP::get(*TheContext, APFloat(0.0)),
-      std::format("{}-forcond", VarName));
-  auto *branch = Builder->CreateBr(end_bb);
+  Builder->CreateCondBr(bool_cond, body_bb, end_bb);
 
-  // Check the condition even on the first iteration
-  auto *then_inst = SplitBlockAndInsertIfThen(bool_cond, branch, false);
-  auto *split_bb = then_inst->getParent();
-  Builder->SetInsertPoint(split_bb);
-  then_inst->eraseFromParent();
+  f->insert(f->end(), body_bb);
+  SSA.seal(body_bb);
+  Builder->SetInsertPoint(body_bb);
 
   // generate Body
+  LoopTarget target{VarName, Fn->StackScopes};
+  Fn->LoopTargets.push_back(&target);
   auto *body = Body->codegen();
+  Fn->LoopTargets.pop_back();
   if (!body)
     return nullptr;
+  codegen_reduction_step(accumulator, join_continues(target, body));
 
   Value *step = Step->codegen();
   if (!step)
     return nullptr;
 
-  Builder->CreateStore(
-      Builder->CreateFAdd(
-          Builder->CreateLoad(Type::getDoubleTy(*TheContext), var_alloc), step,
-          std::format("{}-nextvar", VarName)),
-      var_alloc);
-  Builder->CreateBr(loop_bb);
+  SSA.write(var, Builder->CreateFAdd(SSA.read(var), step,
+                                     std::format("{}-nextvar", VarName)));
+  attach_loop_hints(Builder->CreateBr(loop_bb), Hints);
+  SSA.seal(loop_bb);
+
+  return codegen_exit(accumulator, target, end_bb);
+}
+
+// Match
+
+// Largest span of integer bounds dispatched with a switch on floor(key)
+static constexpr double MATCH_TABLE_MAX_SPAN = 256;
+
+Value *MatchExprAST::codegen() {
+  Value *key = Key->codegen();
+  if (!key)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+
+  auto *f = Builder->GetInsertBlock()->getParent();
+  auto *else_bb = BasicBlock::Create(*TheContext, "match-else");
+  auto *end_bb = BasicBlock::Create(*TheContext, "match-end");
+  std::vector<BasicBlock *> arm_blocks;
+  for (size_t i = 0; i < Arms.size(); ++i)
+    arm_blocks.push_back(BasicBlock::Create(*TheContext, "match-arm"));
+
+  if (Arms.front().Keys.empty())
+    codegen_range_dispatch(key, arm_blocks, else_bb);
+  else
+    codegen_key_switch(key, arm_blocks, else_bb);
+  for (auto *bb : arm_blocks)
+    SSA.seal(bb);
+  SSA.seal(else_bb);
+
+  IncomingValues results;
+  auto codegen_arm = [&](BasicBlock *bb, ExprAST *body) {
+    f->insert(f->end(), bb);
+    Builder->SetInsertPoint(bb);
+    Value *value = body ? body->codegen()
+                        : ConstantFP::get(*TheContext, APFloat(0.0));
+    if (!value)
+      return false;
+    results.emplace_back(value, Builder->GetInsertBlock());
+    Builder->CreateBr(end_bb);
+    return true;
+  };
+  for (size_t i = 0; i < Arms.size(); ++i)
+    if (!codegen_arm(arm_blocks[i], Arms[i].Body.get()))
+      return nullptr;
+  if (!codegen_arm(else_bb, Else.get()))
+    return nullptr;
 
   f->insert(f->end(), end_bb);
+  SSA.seal(end_bb);
   Builder->SetInsertPoint(end_bb);
-  NamedValues[VarName] = old_pointer;
-  return ConstantFP::get(*TheContext, APFloat(0.0));
+  return join_values(results, "matchvalue");
+}
+
+// Keys are integers, so only keys with an exact i64 value can match
+void MatchExprAST::codegen_key_switch(Value *key,
+                                      ArrayRef<BasicBlock *> arm_blocks,
+                                      BasicBlock *else_bb) {
+  auto *f = Builder->GetInsertBlock()->getParent();
+  auto *i64 = Type::getInt64Ty(*TheContext);
+  Value *int_key = Builder->CreateIntrinsic(
+      Intrinsic::fptosi_sat, {i64, key->getType()}, {key}, nullptr, "intkey");
+  Value *is_integer = Builder->CreateFCmpOEQ(
+      Builder->CreateSIToFP(int_key, key->getType()), key, "isinteger");
+
+  auto *switch_bb = BasicBlock::Create(*TheContext, "match-switch", f);
+  Builder->CreateCondBr(is_integer, switch_bb, else_bb);
+  Builder->SetInsertPoint(switch_bb);
+
+  auto *switch_inst = Builder->CreateSwitch(int_key, else_bb);
+  for (size_t i = 0; i < Arms.size(); ++i)
+    for (double k : Arms[i].Keys)
+      switch_inst->addCase(ConstantInt::get(*TheContext,
+                                            APInt(64, (int64_t)k, true)),
+                           arm_blocks[i]);
+}
+
+// Ranges split the numbers into segments at their bounds: Targets[i] gets
+// the keys in [Bounds[i - 1], Bounds[i]).
+static void codegen_range_tree(Value *key, ArrayRef<double> bounds,
+                               ArrayRef<BasicBlock *> targets) {
+  if (bounds.empty()) {
+    Builder->CreateBr(targets.front());
+    return;
+  }
+
+  auto *f = Builder->GetInsertBlock()->getParent();
+  size_t mid = bounds.size() / 2;
+  auto *below_bb = BasicBlock::Create(*TheContext, "match-below", f);
+  auto *above_bb = BasicBlock::Create(*TheContext, "match-above", f);
+  Builder->CreateCondBr(
+      Builder->CreateFCmpOLT(key, ConstantFP::get(key->getType(), bounds[mid])),
+      below_bb, above_bb);
+
+  Builder->SetInsertPoint(below_bb);
+  codegen_range_tree(key, bounds.take_front(mid), targets.take_front(mid + 1));
+  Builder->SetInsertPoint(above_bb);
+  codegen_range_tree(key, bounds.drop_front(mid + 1),
+                     targets.drop_front(mid + 1));
+}
+
+// Integer bounds close enough together become a switch on floor(key), which
+// LLVM turns into a jump table. Other bounds are bisected with compares.
+void MatchExprAST::codegen_range_dispatch(Value *key,
+                                          ArrayRef<BasicBlock *> arm_blocks,
+                                          BasicBlock *else_bb) {
+  std::vector<size_t> order(Arms.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return Arms[a].Low.value_or(-HUGE_VAL) < Arms[b].Low.value_or(-HUGE_VAL);
+  });
+
+  std::vector<double> bounds;
+  std::vector<BasicBlock *> targets = {else_bb};
+  for (size_t i : order) {
+    auto &arm = Arms[i];
+    if (!arm.Low)
+      targets.back() = arm_blocks[i];
+    else if (!bounds.empty() && bounds.back() == *arm.Low)
+      targets.back() = arm_blocks[i]; // starts where the previous one ends
+    else {
+      bounds.push_back(*arm.Low);
+      targets.push_back(arm_blocks[i]);
+    }
+    if (arm.High) {
+      bounds.push_back(*arm.High);
+      targets.push_back(else_bb);
+    }
+  }
+
+  // NaN is in no range
+  auto *f = Builder->GetInsertBlock()->getParent();
+  auto *ordered_bb = BasicBlock::Create(*TheContext, "match-ordered", f);
+  Builder->CreateCondBr(Builder->CreateFCmpORD(key, key), ordered_bb, else_bb);
+  Builder->SetInsertPoint(ordered_bb);
+
+  bool integer_bounds = bounds.size() > 2 &&
+                        bounds.back() - bounds.front() <= MATCH_TABLE_MAX_SPAN;
+  for (double bound : bounds)
+    integer_bounds = integer_bounds && std::trunc(bound) == bound;
+  if (!integer_bounds) {
+    codegen_range_tree(key, bounds, targets);
+    return;
+  }
+
+  // keys outside of [first bound, last bound) are in the outer segments
+  auto *table_bb = BasicBlock::Create(*TheContext, "match-table", f);
+  codegen_range_tree(key, {bounds.front(), bounds.back()},
+                     {targets.front(), table_bb, targets.back()});
+
+  Builder->SetInsertPoint(table_bb);
+  auto *i64 = Type::getInt64Ty(*TheContext);
+  Value *bucket = Builder->CreateFPToSI(
+      Builder->CreateUnaryIntrinsic(Intrinsic::floor, key), i64, "bucket");
+  auto *switch_inst = Builder->CreateSwitch(bucket, else_bb);
+  for (size_t i = 1; i + 1 < targets.size(); ++i) {
+    if (targets[i] == else_bb)
+      continue;
+    for (double k = bounds[i - 1]; k < bounds[i]; ++k)
+      switch_inst->addCase(
+          ConstantInt::get(*TheContext, APInt(64, (int64_t)k, true)),
+          targets[i]);
+  }
 }
 
 Value *WithExprAST::codegen() {
-  std::vector<AllocaInst *> old_values;
+  SymbolScope scope(Fn->Symbols);
+  std::vector<std::unique_ptr<RecordArray>> arrays;
+  Value *saved_stack = nullptr;
   Function *f = Builder->GetInsertBlock()->getParent();
 
   for (int i = 0, e = Variables.size(); i != e; ++i) {
@@ -327,7 +1657,23 @@ Value *WithExprAST::codegen() {
     auto &variable_name = Variables[i].first;
     ExprAST *init = Variables[i].second.get();
 
-    AllocaInst *ptr = create_entry_block_alloca(f, variable_name);
+    if (auto *array_init = dyn_cast_or_null<RecordArrayExprAST>(init)) {
+      // dynamically sized arrays live on the stack until the body is done
+      if (!array_init->is_static() && !saved_stack) {
+        saved_stack = Builder->CreateStackSave("withstack");
+        ++Fn->StackScopes;
+      }
+
+      auto array = std::make_unique<RecordArray>();
+      if (!array_init->codegen_array(*array, variable_name))
+        return nullptr;
+
+      Fn->Symbols.insert(variable_name, {nullptr, array.get()});
+      arrays.push_back(std::move(array));
+      continue;
+    }
+
+    LocalVariable *var = SSA.create(f, variable_name);
 
     Value *initial_val;
     if (init) {
@@ -338,10 +1684,9 @@ Value *WithExprAST::codegen() {
       initial_val = ConstantFP::get(*TheContext, APFloat(0.0));
     }
 
-    Builder->CreateStore(initial_val, ptr);
+    SSA.write(var, initial_val);
 
-    old_values.push_back(NamedValues[variable_name]);
-    NamedValues[variable_name] = ptr;
+    Fn->Symbols.insert(variable_name, {var});
   }
 
   DebugInfoInserter::emit_location(this);
@@ -350,8 +1695,171 @@ Value *WithExprAST::codegen() {
   if (!body)
     return nullptr;
 
-  for (int i = 0, e = Variables.size(); i != e; ++i)
-    NamedValues[Variables[i].first] = old_values[i];
+  if (saved_stack) {
+    Builder->CreateStackRestore(saved_stack);
+    --Fn->StackScopes;
+  }
 
   return body;
 }
+
+// Records
+
+Type *RecordAST::get_field_type(unsigned idx) const {
+  if (Fields[idx].IsInt)
+    return Type::getInt64Ty(*TheContext);
+  return Type::getDoubleTy(*TheContext);
+}
+
+StructType *RecordAST::get_struct_type() const {
+  std::vector<Type *> types;
+  for (unsigned i = 0, e = Fields.size(); i != e; ++i)
+    types.push_back(get_field_type(i));
+  return StructType::get(*TheContext, types);
+}
+
+Value *RecordArray::get_field_address(unsigned field, Value *index) const {
+  // AoS: fields of one element are adjacent, so a field is strided by the
+  // record size. SoA: every field has its own contiguous array.
+  if (Layout == RecordLayout::AoS)
+    return Builder->CreateInBoundsGEP(Record->get_struct_type(), Base,
+                                      {index, Builder->getInt32(field)},
+                                      "fieldptr");
+  return Builder->CreateInBoundsGEP(Record->get_field_type(field),
+                                    FieldBases[field], index, "fieldptr");
+}
+
+bool RecordArrayExprAST::is_static() const {
+  return isa<NumberExprAST>(Count.get());
+}
+
+Value *RecordArrayExprAST::codegen() {
+  return log_error_v(
+      std::format("Array of record {} must be bound by a `with` expression",
+                  Record->get_name())
+          .c_str());
+}
+
+bool RecordArrayExprAST::codegen_array(RecordArray &array, StringRef name) {
+  array.Record = Record;
+  array.Layout = Layout;
+
+  Function *f = Builder->GetInsertBlock()->getParent();
+  auto *int_type = Type::getInt64Ty(*TheContext);
+  const DataLayout &DL = TheModule->getDataLayout();
+
+  auto check_size = [](double size) {
+    if (size < 1)
+      log_error_v("Size of a record array must be positive");
+    else if (size != std::floor(size))
+      log_error_v("Size of a record array must be an integer");
+    else
+      return true;
+    return false;
+  };
+
+  Value *count;
+  if (auto *size = dyn_cast<NumberExprAST>(Count.get())) {
+    if (!check_size(size->get_value()))
+      return false;
+    count = ConstantInt::get(int_type, (uint64_t)size->get_value());
+  } else {
+    if (!(count = Count->codegen()))
+      return false;
+    if (auto *size = dyn_cast<ConstantFP>(count)) {
+      if (!check_size(size->getValueAPF().convertToDouble()))
+        return false;
+    } else {
+      // known at run time only: a size below 1 (or NaN) traps
+      auto *bad_bb = BasicBlock::Create(*TheContext, "badsize", f);
+      auto *ok_bb = BasicBlock::Create(*TheContext, "sizeok", f);
+      Builder->CreateCondBr(
+          Builder->CreateFCmpULT(count, ConstantFP::get(count->getType(), 1.0),
+                                 "sizecheck"),
+          bad_bb, ok_bb);
+      SSA.seal(bad_bb);
+      SSA.seal(ok_bb);
+      Builder->SetInsertPoint(bad_bb);
+      Builder->CreateIntrinsic(Intrinsic::trap, {}, {});
+      Builder->CreateUnreachable();
+      Builder->SetInsertPoint(ok_bb);
+    }
+    count = Builder->CreateFPToSI(count, int_type, "count");
+  }
+
+  DebugInfoInserter::emit_location(this);
+
+  // Constant sized arrays go through the entry block like any other local,
+  // others are allocated where they are bound. Both start zeroed like `with`
+  // scalars do.
+  auto allocate = [&](Type *type, const std::string &alloca_name) {
+    AllocaInst *ptr =
+        is_static() ? create_entry_block_alloca(f, alloca_name, type, count)
+                    : Builder->CreateAlloca(type, count, alloca_name);
+    Value *bytes = Builder->CreateMul(
+        count, ConstantInt::get(int_type, DL.getTypeAllocSize(type)));
+    Builder->CreateMemSet(ptr, Builder->getInt8(0), bytes, ptr->getAlign());
+    return ptr;
+  };
+
+  if (Layout == RecordLayout::AoS) {
+    array.Base = allocate(Record->get_struct_type(), name.str());
+    return true;
+  }
+
+  auto &fields = Record->get_fields();
+  for (unsigned i = 0, e = fields.size(); i != e; ++i)
+    array.FieldBases.push_back(
+        allocate(Record->get_field_type(i),
+                 std::format("{}.{}", name.str(), fields[i].Name)));
+  return true;
+}
+
+Value *FieldExprAST::get_address(Type *&field_type) {
+  RecordArray *array = Fn->Symbols.lookup(ArrayName).Array;
+  if (!array)
+    return log_error_v(
+        std::format("Unknown record array {}", ArrayName).c_str());
+
+  int field = array->Record->get_field_index(FieldName);
+  if (field < 0)
+    return log_error_v(std::format("Record {} has no field {}",
+                                   array->Record->get_name(), FieldName)
+                           .c_str());
+
+  Value *index = Index->codegen();
+  if (!index)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+
+  index = Builder->CreateFPToSI(index, Type::getInt64Ty(*TheContext), "index");
+  field_type = array->Record->get_field_type(field);
+  return array->get_field_address(field, index);
+}
+
+Value *FieldExprAST::codegen() {
+  Type *field_type;
+  Value *ptr = get_address(field_type);
+  if (!ptr)
+    return nullptr;
+
+  Value *val = Builder->CreateLoad(field_type, ptr, FieldName);
+  if (field_type->isIntegerTy())
+    val = Builder->CreateSIToFP(val, Type::getDoubleTy(*TheContext),
+                                "fieldtmp");
+  return val;
+}
+
+Value *FieldExprAST::codegen_store(Value *val) {
+  Type *field_type;
+  Value *ptr = get_address(field_type);
+  if (!ptr)
+    return nullptr;
+
+  Value *stored = val;
+  if (field_type->isIntegerTy())
+    stored = Builder->CreateFPToSI(val, field_type, "fieldint");
+  Builder->CreateStore(stored, ptr);
+  return val; // assignment returns value as C and C++
+}
@@ -2,6 +2,7 @@
 #include "internal.h"
 #include "lex.h"
 #include "parser.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Support/CodeGen.h"
@@ -48,6 +49,9 @@ static void handle_unit() {
     case tok_extern:
       handle_extern();
       break;
+    case tok_record:
+      handle_record();
+      break;
     default:
       handle_top_level_expression();
       break;
@@ -55,10 +59,36 @@ static void handle_unit() {
   }
 }
 
+// What the REPL needs to use the compiled definitions without compiling them
+// again: output.hkl declares them, with their annotations and precedences,
+// and output.bc has their IR, for inlining and for the attributes inferred
+// from the bodies.
+static bool write_manifest() {
+  std::error_code EC;
+  raw_fd_ostream header("output.hkl", EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+  header << "# generated by kppc\n";
+  for (auto &[name, proto] : FunctionProtos)
+    if (proto->has_body() && name != "main")
+      header << proto->to_extern() << "\n";
+
+  raw_fd_ostream bitcode("output.bc", EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+  WriteBitcodeToFile(*TheModule, bitcode);
+  return true;
+}
+
 int main() {
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
+  initialize_options();
   InitializeAllTargetInfos();
   InitializeAllTargets();
   InitializeAllTargetMCs();
@@ -96,6 +126,10 @@ int main() {
     return 1;
   }
 
+  // before codegen, which changes the IR
+  if (MANIFEST && !write_manifest())
+    return 1;
+
   legacy::PassManager pass;
   auto file_type = CodeGenFileType::AssemblyFile;
 
@@ -14,20 +14,36 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 #include <memory>
 
+// for DynamicThreadPoolTaskDispatcher's thread limit and CodeGenOptLevel
+#if LLVM_VERSION_MAJOR < 19
+#error "K++ needs LLVM 19 or later"
+#endif
+
 namespace llvm {
 namespace orc {
 
@@ -38,19 +54,47 @@ private:
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  // Calls to user functions go through these, see addStub
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  std::unique_ptr<LazyCallThroughManager> LazyCalls;
+
+  std::unique_ptr<ObjectCache> Cache; // for CompileLayer, may be null
   RTDyldObjectLinkingLayer ObjectLayer;
+  IRCompileLayer FastCompileLayer; // no codegen optimisation, for tier 0
   IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer; // over CompileLayer, see setOptimizer
+  // the same without Cache, for code run once
+  IRCompileLayer UncachedCompileLayer;
+  IRTransformLayer UncachedOptimizeLayer;
+  JITTargetMachineBuilder TargetJTMB;
 
   JITDylib &MainJD;
 
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  std::unique_ptr<ObjectCache> Cache = nullptr)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        Stubs(createLocalIndirectStubsManagerBuilder(
+            JTMB.getTargetTriple())()),
+        LazyCalls(cantFail(createLocalLazyCallThroughManager(
+            JTMB.getTargetTriple(), *this->ES,
+            ExecutorAddr::fromPtr(&handleLazyCompileError)))),
+        Cache(std::move(Cache)),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
+        FastCompileLayer(*this->ES, ObjectLayer,
+                         std::make_unique<ConcurrentIRCompiler>(
+                             withOptLevel(JTMB, CodeGenOptLevel::None))),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<ConcurrentIRCompiler>(
+                         withOptLevel(JTMB, CachedOptLevel),
+                         this->Cache.get())),
+        OptimizeLayer(*this->ES, CompileLayer),
+        UncachedCompileLayer(*this->ES, ObjectLayer,
+                             std::make_unique<ConcurrentIRCompiler>(JTMB)),
+        UncachedOptimizeLayer(*this->ES, UncachedCompileLayer),
+        TargetJTMB(JTMB),
         MainJD(this->ES->createBareJITDylib("<main>")) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
@@ -61,42 +105,178 @@ public:
     }
   }
 
+  // Codegen level of the modules the cache keeps, which its keys include
+  static constexpr CodeGenOptLevel CachedOptLevel = CodeGenOptLevel::Default;
+
+  static JITTargetMachineBuilder withOptLevel(JITTargetMachineBuilder JTMB,
+                                              CodeGenOptLevel Level) {
+    JTMB.setCodeGenOptLevel(Level);
+    return JTMB;
+  }
+
+  static void handleLazyCompileError() {
+    fprintf(stderr, "\rError: a lazily compiled function failed to build\n");
+    exit(1);
+  }
+
   ~KaleidoscopeJIT() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  // Materialises on up to Threads workers, or in place on the thread looking
+  // a symbol up when Threads is 0. Cache, if any, keeps the optimised
+  // modules' objects (tier 0 and Compile::Once are compiled every time).
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(unsigned Threads, std::unique_ptr<ObjectCache> Cache = nullptr) {
+    std::unique_ptr<TaskDispatcher> D;
+    if (Threads)
+      D = std::make_unique<DynamicThreadPoolTaskDispatcher>(Threads);
+    else
+      D = std::make_unique<InPlaceTaskDispatcher>();
+    auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(D));
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    // the host's CPU and features, for codegen and the optimisers' costs
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*JTMB),
+                                             std::move(*DL), std::move(Cache));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  // Describes the code the JIT generates, for the target costs of passes run
+  // before it
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return TargetJTMB.createTargetMachine();
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
-  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+  // Runs Optimize on every module added with Compile::Optimize or Once, on
+  // the thread materialising it. Each module gets a target machine of its
+  // own for the cost models, as the workers may optimise several at once.
+  void setOptimizer(std::function<void(Module &, TargetMachine &)> Optimize) {
+    auto Transform =
+        [this, Optimize = std::move(Optimize)](
+            ThreadSafeModule TSM,
+            MaterializationResponsibility &) -> Expected<ThreadSafeModule> {
+      auto TM = createTargetMachine();
+      if (!TM)
+        return TM.takeError();
+      TSM.withModuleDo([&](Module &M) { Optimize(M, **TM); });
+      return std::move(TSM);
+    };
+    OptimizeLayer.setTransform(Transform);
+    UncachedOptimizeLayer.setTransform(std::move(Transform));
+  }
+
+  // Fast is tier 0, without any optimisation. Optimized modules skip the
+  // optimiser but not the codegen optimisations. Once is Optimize for code
+  // run a single time, which the cache would only fill up.
+  enum class Compile { Optimize, Fast, Optimized, Once };
+
+  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr,
+                  Compile How = Compile::Optimize) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM)); 
+    switch (How) {
+    case Compile::Fast:
+      return FastCompileLayer.add(RT, std::move(TSM));
+    case Compile::Optimized:
+      return CompileLayer.add(RT, std::move(TSM));
+    case Compile::Once:
+      return UncachedOptimizeLayer.add(RT, std::move(TSM));
+    default:
+      return OptimizeLayer.add(RT, std::move(TSM));
+    }
+  }
+
+  // Resolves what the main dylib does not define from the archive at Path,
+  // loading its members on first use. They go in a dylib of their own, which
+  // the main one links against, so that the stubs of redefinitions take
+  // precedence over the archive's functions.
+  Error addStaticLibrary(const char *Path) {
+    auto Archive = StaticLibraryDefinitionGenerator::Load(ObjectLayer, Path);
+    if (!Archive)
+      return Archive.takeError();
+    auto LibJD = ES->createJITDylib(Path);
+    if (!LibJD)
+      return LibJD.takeError();
+    LibJD->addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            DL.getGlobalPrefix())));
+    LibJD->addGenerator(std::move(*Archive));
+    MainJD.addToLinkOrder(*LibJD);
+    return Error::success();
+  }
+
+  // Lets the generated code call Fn under Name
+  Error addHostFunction(StringRef Name, void *Fn) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          {ExecutorAddr::fromPtr(Fn),
+           JITSymbolFlags::Exported | JITSymbolFlags::Callable}}}));
+  }
+
+  void runInBackground(unique_function<void()> Work) {
+    ES->dispatchTask(makeGenericNamedTask(std::move(Work), "background"));
   }
 
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  // Starts materialising Name without waiting for it
+  void lookupAsync(StringRef Name,
+                   unique_function<void(Expected<ExecutorAddr>)> OnReady) {
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+        SymbolLookupSet(Mangle(Name.str())), SymbolState::Ready,
+        [OnReady = std::move(OnReady)](Expected<SymbolMap> Result) mutable {
+          if (!Result)
+            return OnReady(Result.takeError());
+          OnReady(Result->begin()->second.getAddress());
+        },
+        NoDependenciesToRegister);
+  }
+
+  // Defines Name as a stub jumping to whatever body updateStub sets, so that
+  // the body can be replaced without recompiling the callers.
+  Error addStub(StringRef Name) {
+    if (Stubs->findStub(Name, true).getAddress())
+      return Error::success();
+    if (auto Err = Stubs->createStub(Name, ExecutorAddr(),
+                                     JITSymbolFlags::Exported |
+                                         JITSymbolFlags::Callable))
+      return Err;
+    return MainJD.define(
+        absoluteSymbols({{Mangle(Name.str()), Stubs->findStub(Name, true)}}));
+  }
+
+  Error updateStub(StringRef Name, ExecutorAddr Body) {
+    return Stubs->updatePointer(Name, Body);
+  }
+
+  // An address to point a stub at instead of Body itself: the first call
+  // through it compiles the module defining Body, passes the address to
+  // NotifyCompiled and goes on into Body.
+  Expected<ExecutorAddr>
+  getLazyBody(StringRef Body,
+              unique_function<Error(ExecutorAddr)> NotifyCompiled) {
+    return LazyCalls->getCallThroughTrampoline(MainJD, Mangle(Body.str()),
+                                               std::move(NotifyCompiled));
+  }
 };
 
 } // end namespace orc
@@ -1,4 +1,6 @@
 #include "internal.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/CodeGen.h"
 #include "llvm/Target/TargetMachine.h"
@@ -6,20 +8,46 @@
 #include "llvm/TargetParser/Host.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
-#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Scalar/WarnMissedTransforms.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <format>
+#include <optional>
+#include <thread>
+#include <vector>
 
 bool DEBUG = false;
+bool FAST_MATH = false;
+IfLowering IF_LOWERING = IfLowering::Auto;
+bool REMARKS = false;
+bool TIME = false;
+unsigned BATCH_SIZE = 1;
+bool LAZY = false;
+unsigned JIT_THREADS = std::thread::hardware_concurrency();
+bool TIERED = false;
+unsigned TIER_THRESHOLD = 1000;
+int OPT_LEVEL = -1;
+std::string CACHE_DIR;
+unsigned CACHE_SIZE = 256;
+bool MANIFEST = false;
 
-std::unique_ptr<LLVMContext> TheContext;
+ThreadSafeContext TheTSC;
+LLVMContext *TheContext;
+static std::vector<ThreadSafeContext> ContextPool;
+static unsigned NextContext = 0;
+static std::optional<ThreadSafeContext::Lock> ContextLock;
 std::unique_ptr<IRBuilder<>> Builder;
 std::unique_ptr<Module> TheModule;
-std::map<std::string, AllocaInst *> NamedValues;
 std::unique_ptr<KaleidoscopeJIT> TheJIT;
 std::unique_ptr<FunctionPassManager> TheFPM;
+std::unique_ptr<FunctionPassManager> TheLoopFPM;
 std::unique_ptr<LoopAnalysisManager> TheLAM;
 std::unique_ptr<FunctionAnalysisManager> TheFAM;
 std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
@@ -33,50 +61,190 @@ std::unique_ptr<DIBuilder> DBuilder;
 // Binary Expression Operations
 //
 std::map<std::string, int> BINOP_PRECEDENCE = {
-    {"=", 2}, {"<", 10}, {">", 10}, {"+", 20}, {"-", 20}, {"*", 40},
+    {"=", 2},   {"||", 5},  {"&&", 6},  {"==", 9},  {"!=", 9},  {"<", 10},
+    {">", 10},  {"<=", 10}, {">=", 10}, {"+", 20},  {"-", 20},  {"*", 40},
+    {"/", 40},  {"%", 40},  {"^", 50},
 };
 
-AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name) {
+AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name,
+                                      Type *type, Value *array_size) {
   IRBuilder<> temp_builder(&function->getEntryBlock(),
                            function->getEntryBlock().begin());
-  return temp_builder.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr,
-                                   var_name);
+  if (!type)
+    type = Type::getDoubleTy(*TheContext);
+  return temp_builder.CreateAlloca(type, array_size, var_name);
 }
 
-void initialize_modules_and_managers_for_jit() {
-  // Open a new context and module.
+static bool env_flag(const char *name) {
+  auto value = std::getenv(name);
+  return value && std::strcmp(value, "1") == 0;
+}
 
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("K++ JIT", *TheContext);
+void initialize_options() {
+  FAST_MATH = env_flag("KPP_FAST_MATH");
+  REMARKS = env_flag("KPP_REMARKS");
+  TIME = env_flag("KPP_TIME");
+  LAZY = env_flag("KPP_LAZY");
+  TIERED = env_flag("KPP_TIERED");
+  MANIFEST = env_flag("KPP_MANIFEST");
+  if (auto threshold = std::getenv("KPP_TIER_THRESHOLD"))
+    if (!(TIER_THRESHOLD = std::strtoul(threshold, nullptr, 10)))
+      TIER_THRESHOLD = 1;
+  if (auto threads = std::getenv("KPP_JIT_THREADS"))
+    JIT_THREADS = std::strtoul(threads, nullptr, 10);
+  if (TIERED && !JIT_THREADS) {
+    fprintf(stderr, "\rWarning: KPP_TIERED needs JIT workers, ignored\n");
+    TIERED = false;
+  }
+  if (auto level = std::getenv("KPP_OPT_LEVEL"))
+    OPT_LEVEL = std::min(std::strtoul(level, nullptr, 10), 3ul);
+  if (auto dir = std::getenv("KPP_CACHE_DIR"))
+    CACHE_DIR = dir;
+  // 0 would leave pruneCache without any bound
+  if (auto size = std::getenv("KPP_CACHE_SIZE"))
+    if (!(CACHE_SIZE = std::strtoul(size, nullptr, 10)))
+      CACHE_SIZE = 1;
+  if (auto batch = std::getenv("KPP_BATCH"))
+    if (!(BATCH_SIZE = std::strtoul(batch, nullptr, 10)))
+      BATCH_SIZE = 1;
 
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+  if (auto if_lowering = std::getenv("KPP_IF_LOWERING")) {
+    if (std::strcmp(if_lowering, "select") == 0)
+      IF_LOWERING = IfLowering::Select;
+    else if (std::strcmp(if_lowering, "branch") == 0)
+      IF_LOWERING = IfLowering::Branch;
+  }
+}
+
+static void set_builder_flags() {
+  if (FAST_MATH) {
+    FastMathFlags FMF;
+    FMF.setFast();
+    Builder->setFastMathFlags(FMF);
+  }
+}
+
+static void add_function_passes() {
+  TheFPM->addPass(InstCombinePass());
+  TheFPM->addPass(ReassociatePass());
+  TheFPM->addPass(GVNPass());
+  TheFPM->addPass(SimplifyCFGPass());
+
+  // Loops are rotated into the shape the loop passes expect, then vectorised
+  // and unrolled following the `for` hints (or the cost models without
+  // them). Hints that could not be followed are reported as warnings.
+  TheLoopFPM->addPass(createFunctionToLoopPassAdaptor(LoopRotatePass()));
+  TheLoopFPM->addPass(LoopVectorizePass());
+  TheLoopFPM->addPass(LoopUnrollPass());
+  TheLoopFPM->addPass(WarnMissedTransformationsPass());
+}
 
+// Diagnostics of the passes, e.g. a `for` hint the optimiser did not follow
+static void handle_diagnostic(const DiagnosticInfo &info, void *) {
+  const char *kind;
+  switch (info.getSeverity()) {
+  case DS_Error:
+    kind = "Error";
+    break;
+  case DS_Warning:
+    kind = "Warning";
+    break;
+  default:
+    if (!REMARKS)
+      return;
+    kind = "Remark";
+  }
+
+  if (auto *opt = dyn_cast<DiagnosticInfoOptimizationBase>(&info)) {
+    std::string where = opt->getFunction().getName().str();
+    if (opt->isLocationAvailable()) {
+      StringRef file;
+      unsigned line, col;
+      opt->getLocation(file, line, col);
+      where = std::format("{}:{} in {}", line, col, where);
+    }
+    fprintf(stderr, "\r%s (%s): %s\n", kind, where.c_str(),
+            opt->getMsg().c_str());
+    return;
+  }
+
+  std::string msg;
+  raw_string_ostream stream(msg);
+  DiagnosticPrinterRawOStream printer(stream);
+  info.print(printer);
+  fprintf(stderr, "\r%s: %s\n", kind, stream.str().c_str());
+}
+
+static ThreadSafeContext create_context() {
+  ThreadSafeContext context(std::make_unique<LLVMContext>());
+  context.getContext()->setDiagnosticHandlerCallBack(handle_diagnostic);
+  return context;
+}
+
+static void use_context(ThreadSafeContext context) {
+  TheTSC = std::move(context);
+  TheContext = TheTSC.getContext();
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  set_builder_flags();
+}
+
+// Builds the pass pipeline, once: the modules come and go, the passes and
+// analyses stay registered and work in whichever context the module has.
+static void initialize_managers(TargetMachine *target_machine) {
   TheFPM = std::make_unique<FunctionPassManager>();
+  TheLoopFPM = std::make_unique<FunctionPassManager>();
   TheLAM = std::make_unique<LoopAnalysisManager>();
   TheFAM = std::make_unique<FunctionAnalysisManager>();
   TheCGAM = std::make_unique<CGSCCAnalysisManager>();
   TheMAM = std::make_unique<ModuleAnalysisManager>();
   ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
+  // The context only lends the instrumentation its pass gate, which is the
+  // process-wide -opt-bisect-limit in every context, so whichever one is
+  // current here stands for the whole pool.
+  TheSI = std::make_unique<StandardInstrumentations>(*TheContext, false);
 
   TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
-  // Add passes
-  TheFPM->addPass(InstCombinePass());
-  TheFPM->addPass(ReassociatePass());
-  TheFPM->addPass(GVNPass());
-  TheFPM->addPass(SimplifyCFGPass());
-  TheFPM->addPass(PromotePass());
+  add_function_passes();
 
-  PassBuilder PB;
+  PassBuilder PB(target_machine); // target costs for the vectoriser
   PB.registerModuleAnalyses(*TheMAM);
   PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
   PB.crossRegisterProxies(
       *TheLAM, *TheFAM, *TheCGAM,
       *TheMAM); // I don't know why the other two were registerd separately
+}
 
-  // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+void initialize_jit() {
+  // one context more than workers, so that generating the next unit never
+  // waits for all of them
+  for (unsigned i = 0; i <= JIT_THREADS; ++i)
+    ContextPool.push_back(create_context());
+  use_context(ContextPool.front());
+  // kept for the TargetIRAnalysis registered in the managers
+  static std::unique_ptr<TargetMachine> target_machine =
+      ExitOnErr(TheJIT->createTargetMachine());
+  initialize_managers(target_machine.get());
+  initialize_module_for_jit();
+}
+
+void release_context() { ContextLock.reset(); }
+
+void initialize_module_for_jit() {
+  release_context();
+  use_context(ContextPool[NextContext++ % ContextPool.size()]);
+  ContextLock.emplace(TheTSC.getLock());
+
+  // Results cached for the previous module would otherwise be found again by
+  // whatever is allocated at the same addresses.
+  TheMAM->clear();
+  TheCGAM->clear();
+  TheFAM->clear();
+  TheLAM->clear();
+
+  TheModule = std::make_unique<Module>("K++ JIT", *TheContext);
+  TheModule->setDataLayout(TheJIT->getDataLayout());
 }
 
 void initialize_module_for_compilation() {
@@ -96,9 +264,8 @@ void initialize_module_for_compilation() {
   TargetOptions opt;
   TheTargetMachine = target->createTargetMachine(target_triple, CPU, features,
                                                  opt, Reloc::PIC_);
-  // Open a new context and module.
-
-  TheContext = std::make_unique<LLVMContext>();
+  use_context(create_context());
+  initialize_managers(TheTargetMachine);
   TheModule = std::make_unique<Module>("K++ Compiler", *TheContext);
 
   TheModule->setDataLayout(TheTargetMachine->createDataLayout());
@@ -106,33 +273,6 @@ void initialize_module_for_compilation() {
 
   // TheModule->setDataLayout(TheJIT->getDataLayout());
 
-  TheFPM = std::make_unique<FunctionPassManager>();
-  TheLAM = std::make_unique<LoopAnalysisManager>();
-  TheFAM = std::make_unique<FunctionAnalysisManager>();
-  TheCGAM = std::make_unique<CGSCCAnalysisManager>();
-  TheMAM = std::make_unique<ModuleAnalysisManager>();
-  ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
-
-  TheSI->registerCallbacks(*ThePIC, TheMAM.get());
-
-  // Add passes
-  TheFPM->addPass(InstCombinePass());
-  TheFPM->addPass(ReassociatePass());
-  TheFPM->addPass(GVNPass());
-  TheFPM->addPass(SimplifyCFGPass());
-  TheFPM->addPass(PromotePass());
-
-  PassBuilder PB;
-  PB.registerModuleAnalyses(*TheMAM);
-  PB.registerFunctionAnalyses(*TheFAM);
-  PB.crossRegisterProxies(
-      *TheLAM, *TheFAM, *TheCGAM,
-      *TheMAM); // I don't know why the other two were registerd separately
-
-  // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
-
   auto debug_env = std::getenv("DEBUG");
   if (debug_env && std::strcmp(debug_env, "1") == 0) {
     DEBUG = true;
@@ -9,7 +9,9 @@
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/IR/DIBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include <map>
+#include <string>
 
 #define ANON_FUNCTION "__anon_expr"
 #define VERBOSE false
@@ -19,14 +21,50 @@
 using namespace llvm;
 using namespace llvm::orc;
 
+
 extern bool DEBUG;
+extern bool FAST_MATH; // KPP_FAST_MATH=1
+
+// KPP_IF_LOWERING=select|branch, `auto` picks by cost
+enum class IfLowering { Auto, Select, Branch };
+extern IfLowering IF_LOWERING;
+
+extern bool REMARKS; // KPP_REMARKS=1, notes on missed optimisations
+// KPP_TIME=1, compile time of each definition and top level expression
+extern bool TIME;
+extern unsigned BATCH_SIZE; // KPP_BATCH=n, definitions per JIT module
+extern bool LAZY;           // KPP_LAZY=1, compile functions on first call
+// KPP_JIT_THREADS=n, JIT workers (all cores by default, 0 for none)
+extern unsigned JIT_THREADS;
+extern bool TIERED;             // KPP_TIERED=1, see tier.h
+extern unsigned TIER_THRESHOLD; // KPP_TIER_THRESHOLD=n
+// KPP_OPT_LEVEL=0..3, whole modules are optimised by the JIT as they are
+// compiled instead of each function as it is generated. -1 when unset.
+extern int OPT_LEVEL;
+// KPP_CACHE_DIR=path, keeps the compiled modules for later sessions, see
+// cache.h. KPP_CACHE_SIZE=n bounds it to n megabytes (at least 1).
+extern std::string CACHE_DIR;
+extern unsigned CACHE_SIZE;
+// KPP_MANIFEST=1, kppc also writes output.hkl and output.bc for the REPL to
+// use the compiled library, see the Makefile
+extern bool MANIFEST;
+
+inline void log_remark(int line, int col, const std::string &msg) {
+  if (REMARKS)
+    fprintf(stderr, "\rRemark (%d:%d): %s\n", line, col, msg.c_str());
+}
 
-extern std::unique_ptr<LLVMContext> TheContext;
+// Context of the unit being generated, taken from a pool of contexts (one
+// for the whole session without JIT workers) and locked while the unit is
+// generated. The units handed to the JIT compile in the other contexts.
+extern ThreadSafeContext TheTSC;
+extern LLVMContext *TheContext; // owned by TheTSC
 extern std::unique_ptr<IRBuilder<>> Builder;
 extern std::unique_ptr<Module> TheModule;
-extern std::map<std::string, AllocaInst *> NamedValues;
 extern std::unique_ptr<KaleidoscopeJIT> TheJIT;
 extern std::unique_ptr<FunctionPassManager> TheFPM;
+// loop passes, run after TheFPM where they are asked for, see codegen.cpp
+extern std::unique_ptr<FunctionPassManager> TheLoopFPM;
 extern std::unique_ptr<LoopAnalysisManager> TheLAM;
 extern std::unique_ptr<FunctionAnalysisManager> TheFAM;
 extern std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
@@ -40,8 +78,14 @@ extern std::unique_ptr<DIBuilder> DBuilder;
 
 extern std::map<std::string, int> BINOP_PRECEDENCE;
 
-AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name);
-void initialize_modules_and_managers_for_jit();
+void initialize_options();
+AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name,
+                                      Type *type = nullptr,
+                                      Value *array_size = nullptr);
+void initialize_jit();
+void initialize_module_for_jit();
+// Lets the JIT compile in the current context, until the next module
+void release_context();
 
 inline void set_lex_source(std::unique_ptr<std::istream> source_stream) {
   reset_lex_loc();
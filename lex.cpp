@@ -80,12 +80,20 @@ char get_operator(char last_char) {
 
 int gettok() {
   static int last_char = ' ';
+  // an identifier directly followed by '.', as in `ps.x`
+  static bool field_access = false;
 
   while (isspace(last_char))
     last_char = get_char();
 
   cur_loc = lex_loc;
 
+  if (field_access) {
+    field_access = false;
+    last_char = get_char(); // eat '.'
+    return '.';
+  }
+
   // State = Identifier
   if (isalpha(last_char)) {
     identifier_str = last_char;
@@ -116,6 +124,19 @@ int gettok() {
       return operator_name.empty() ? tok_identifier : tok_unary;
     } else if (identifier_str == "with")
       return tok_with;
+    else if (identifier_str == "record")
+      return tok_record;
+    else if (identifier_str == "while")
+      return tok_while;
+    else if (identifier_str == "break")
+      return tok_break;
+    else if (identifier_str == "continue")
+      return tok_continue;
+    else if (identifier_str == "match")
+      return tok_match;
+    else if (identifier_str == "when")
+      return tok_when;
+    field_access = last_char == '.';
     return tok_identifier;
   }
 
@@ -55,7 +55,19 @@ enum Token {
   tok_operator = -14,
 
   // var
-  tok_with = -15
+  tok_with = -15,
+
+  // record Name (field...) [layout soa|aos]
+  tok_record = -16,
+
+  // while condition do expression end
+  tok_while = -17,
+  tok_break = -18,
+  tok_continue = -19,
+
+  // match key when pattern then expression ... [else expression] end
+  tok_match = -20,
+  tok_when = -21
 };
 
 void reset_lex_loc();
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Runs each lib/tests/*.kl through kpp in every mode below and compares what
+# it prints with the .out file next to it. The modes change how the code is
+# compiled, never what it prints, so one .out serves them all.
+#
+#   lib/tests/run.sh [kpp]      (./kpp by default)
+
+set -o pipefail
+
+KPP=$(realpath -- "${1:-./kpp}")
+cd "$(dirname -- "$0")/../.." # kpp loads lib/ from the working directory
+
+CACHE=$(mktemp -d)
+trap 'rm -r "$CACHE"' EXIT
+
+# name:environment. The cache is empty for the first session of each
+# script and filled for the second.
+MODES=(
+  "default:"
+  "batched:KPP_BATCH=8"
+  "lazy:KPP_LAZY=1"
+  "tiered:KPP_TIERED=1 KPP_TIER_THRESHOLD=2"
+  "optimised:KPP_OPT_LEVEL=3"
+  "cache-cold:KPP_CACHE_DIR=$CACHE"
+  "cache-warm:KPP_CACHE_DIR=$CACHE"
+)
+
+# Evaluations, printd and errors, without the prompts and the tier ups,
+# which come whenever the workers are done
+filter() {
+  tr -d '\r' | sed 's/>> //g' | grep -v -e '^$' -e '^Tier up ('
+}
+
+# see load_library in repl.cpp
+library_is_current() {
+  for built in lib/klpp.a lib/klpp.hkl lib/klpp.bc; do
+    [ -e "$built" ] || return 1
+    for source in lib/core.kl lib/builtin.kl lib/core.hkl lib/external.cpp; do
+      [ "$source" -nt "$built" ] && return 1
+    done
+  done
+  return 0
+}
+if library_is_current; then
+  echo "library: lib/klpp.a"
+else
+  echo "library: lib/core.kl and lib/builtin.kl (make all to link lib/klpp.a)"
+fi
+
+failures=0
+for mode in "${MODES[@]}"; do
+  name=${mode%%:*}
+  for test in lib/tests/*.kl; do
+    actual=$(env ${mode#*:} "$KPP" < "$test" 2>&1 > /dev/null | filter)
+    if diff -u "${test%.kl}.out" <(echo "$actual") > /dev/null; then
+      echo "PASS $name $(basename "$test")"
+    else
+      echo "FAIL $name $(basename "$test")"
+      diff -u "${test%.kl}.out" <(echo "$actual")
+      failures=$((failures + 1))
+    fi
+  done
+done
+
+exit $((failures > 0))
@@ -0,0 +1,169 @@
+#include "optimizer.h"
+#include "internal.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <map>
+#include <mutex>
+#include <set>
+
+// Every definition lives in its own module in the JIT, which is handed over
+// with it, so the bodies are kept as bitcode and parsed into the module that
+// needs them.
+static std::map<std::string, std::string> FunctionIR;
+static std::mutex FunctionIRMutex; // tier 1 inlines on the JIT workers
+
+// F alone in a module of its own, with declarations of the functions it
+// calls. CloneModule would go through the whole module of F, which is the
+// entire library when lib/klpp.bc is loaded.
+static std::unique_ptr<Module> clone_function(Function &F) {
+  auto M = std::make_unique<Module>(F.getName(), F.getContext());
+  M->setDataLayout(F.getParent()->getDataLayout());
+
+  ValueToValueMapTy VMap;
+  auto declare = [&](Function &G) {
+    auto *copy = Function::Create(G.getFunctionType(), G.getLinkage(),
+                                  G.getName(), M.get());
+    copy->copyAttributesFrom(&G);
+    VMap[&G] = copy;
+    return copy;
+  };
+  Function *clone = declare(F);
+  for (auto &I : instructions(F))
+    for (auto &op : I.operands())
+      if (auto *callee = dyn_cast<Function>(op->stripPointerCasts()))
+        if (!VMap.count(callee))
+          declare(*callee);
+  for (auto [arg, clone_arg] : zip(F.args(), clone->args()))
+    VMap[&arg] = &clone_arg;
+
+  SmallVector<ReturnInst *, 4> returns;
+  CloneFunctionInto(clone, &F, VMap, CloneFunctionChangeType::DifferentModule,
+                    returns);
+  return M;
+}
+
+void save_function_ir(Function &F) {
+  std::string name = F.getName().str();
+
+  if (!F.hasFnAttribute(Attribute::AlwaysInline)) {
+    forget_function_ir(name);
+    return;
+  }
+
+  auto M = clone_function(F);
+  std::string bitcode;
+  raw_string_ostream os(bitcode);
+  WriteBitcodeToFile(*M, os);
+  os.flush();
+  std::lock_guard<std::mutex> lock(FunctionIRMutex);
+  FunctionIR[name] = std::move(bitcode);
+}
+
+void forget_function_ir(const std::string &name) {
+  std::lock_guard<std::mutex> lock(FunctionIRMutex);
+  FunctionIR.erase(name);
+}
+
+static bool has_function_ir(const std::string &name) {
+  std::lock_guard<std::mutex> lock(FunctionIRMutex);
+  return FunctionIR.count(name);
+}
+
+// Links the saved body of the declaration callee into its module
+static bool link_saved_body(Function &callee) {
+  std::string bitcode;
+  {
+    std::lock_guard<std::mutex> lock(FunctionIRMutex);
+    auto ir = FunctionIR.find(callee.getName().str());
+    if (ir == FunctionIR.end())
+      return false;
+    bitcode = ir->second;
+  }
+
+  auto M = parseBitcodeFile(MemoryBufferRef(bitcode, callee.getName()),
+                            callee.getContext());
+  if (!M) {
+    consumeError(M.takeError());
+    return false;
+  }
+
+  // only the functions declared in the destination are taken over, so this
+  // brings in the callee and nothing else
+  if (Linker::linkModules(*callee.getParent(), std::move(*M),
+                          Linker::Flags::LinkOnlyNeeded))
+    return false;
+  return !callee.isDeclaration();
+}
+
+void inline_saved_callees(Function &F) {
+  std::vector<CallInst *> calls;
+  for (auto &I : instructions(F)) {
+    auto *call = dyn_cast<CallInst>(&I);
+    if (!call)
+      continue;
+    Function *callee = call->getCalledFunction();
+    if (callee && callee != &F &&
+        !callee->hasFnAttribute(Attribute::NoInline) &&
+        has_function_ir(callee->getName().str()))
+      calls.push_back(call);
+  }
+
+  // a callee generated into the same module (a batch of definitions) has
+  // its body at hand already
+  std::set<Function *> linked;
+  for (auto *call : calls) {
+    Function *callee = call->getCalledFunction();
+    if (callee->isDeclaration() && !linked.count(callee) &&
+        link_saved_body(*callee))
+      linked.insert(callee);
+  }
+
+  for (auto *call : calls) {
+    if (call->getCalledFunction()->isDeclaration())
+      continue;
+    InlineFunctionInfo IFI;
+    InlineFunction(*call, IFI);
+  }
+
+  // the callee itself is still provided by the module it was compiled in
+  for (auto *callee : linked)
+    callee->deleteBody();
+}
+
+void optimize_module(Module &M, unsigned level, TargetMachine *TM) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB(TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  switch (level) {
+  case 0:
+    MPM = PB.buildO0DefaultPipeline(OptimizationLevel::O0);
+    break;
+  case 1:
+    MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O1);
+    break;
+  case 2:
+    MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+    break;
+  default:
+    MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+  }
+  MPM.run(M, MAM);
+}
@@ -0,0 +1,29 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/Target/TargetMachine.h"
+#include <string>
+
+using namespace llvm;
+
+// Functions annotated `inline` are inlined into callers compiled in later
+// modules. Those callers keep the body they copied when the function is
+// redefined, so other functions, which a redefinition must reach through
+// their stubs, are never inlined across definitions.
+
+// Keeps the optimised IR of F as bitcode if it is annotated `inline`.
+void save_function_ir(Function &F);
+void forget_function_ir(const std::string &name);
+
+// Clones the bodies of saved callees of F into its module, inlines the calls
+// and turns the callees back into declarations. Saved callees defined in the
+// same module are inlined as they are.
+void inline_saved_callees(Function &F);
+
+// The whole-module pipeline of clang -O<level>. It sets up its own analyses,
+// so several modules (in different contexts) can be optimised at once. TM
+// gives the vectoriser and the unroller the target costs.
+void optimize_module(Module &M, unsigned level, TargetMachine *TM = nullptr);
+
+#endif
@@ -2,24 +2,155 @@
 #include "ast.h"
 #include "internal.h"
 #include "lex.h"
+#include "optimizer.h"
+#include "tier.h"
+#include "llvm/ADT/STLExtras.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstring>
+#include <format>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <utility>
 
 // The main code
 
 int cur_tok = 0;
 static std::unique_ptr<ExprAST> parse_expression();
 
-void delete_function_if_exists(const std::string &name) {
-  auto rt = FunctionRTs.find(name);
-  if (rt != FunctionRTs.end()) {
-    ExitOnErr(rt->second->get()->remove());
-    FunctionRTs.erase(rt);
+#ifndef COMPILATION
+// Definitions generated into TheModule that the JIT does not have yet, as
+// the name callers use and the version holding the body
+static std::vector<std::pair<std::string, std::string>> PendingDefinitions;
+static std::map<std::string, unsigned> Versions;
+static std::map<std::string, std::string> CurrentVersions;
+static std::set<std::string> Tier1Versions; // see tier.h
+// Functions whose current version lives in the module of a tracker. The
+// module is removed once every function in it has been redefined.
+static std::map<ResourceTracker *, unsigned> LiveDefinitions;
+
+// Moves the body of F into `name$vN` and leaves F as a declaration: every
+// call goes through the stub the JIT keeps under the plain name, which a
+// redefinition repoints without touching the callers.
+static std::string split_version(Function &F) {
+  std::string name = F.getName().str();
+  auto version = std::format("{}$v{}", name, ++Versions[name]);
+  auto *body = Function::Create(F.getFunctionType(), F.getLinkage(), version,
+                                F.getParent());
+  body->copyAttributesFrom(&F);
+  body->splice(body->end(), &F);
+  for (auto [arg, body_arg] : zip(F.args(), body->args())) {
+    body_arg.takeName(&arg);
+    arg.replaceAllUsesWith(&body_arg);
+  }
+  return version;
+}
+
+// Versions are compiled on the JIT workers, which repoint the stubs too
+static std::mutex StubsMutex;
+
+// Points the stub of name at the version, and drops the module of the
+// previous version if nothing in it is called any more. The stub starts at
+// a trampoline compiling the version on its first call. Unless KPP_LAZY is
+// set, the workers start compiling it right away as well, and whichever is
+// done first points the stub at the code.
+static void publish_version(const std::string &name,
+                            const std::string &version,
+                            const ResourceTrackerSP &RT) {
+  auto notify_compiled = [=](ExecutorAddr addr) -> Error {
+    std::lock_guard<std::mutex> lock(StubsMutex);
+    // the stub may have moved on to a newer version or tier in the meantime
+    if (CurrentVersions[name] != version || Tier1Versions.count(version))
+      return Error::success();
+    return TheJIT->updateStub(name, addr);
+  };
+  auto trampoline = ExitOnErr(TheJIT->getLazyBody(version, notify_compiled));
+  std::string previous;
+  {
+    std::lock_guard<std::mutex> lock(StubsMutex);
+    ExitOnErr(TheJIT->updateStub(name, trampoline));
+    previous = std::exchange(CurrentVersions[name], version);
+    Tier1Versions.erase(previous);
+  }
+  if (!previous.empty())
+    retire_tier1(previous);
+  if (!LAZY)
+    TheJIT->lookupAsync(version, [=](Expected<ExecutorAddr> addr) {
+      // a failure shows again when the trampoline is called
+      if (!addr)
+        return consumeError(addr.takeError());
+      if (auto err = notify_compiled(*addr))
+        consumeError(std::move(err));
+    });
+
+  ++LiveDefinitions[RT.get()];
+  auto &current = FunctionRTs[name];
+  if (current && --LiveDefinitions[current.get()] == 0) {
+    LiveDefinitions.erase(current.get());
+    ExitOnErr(current->remove());
+  }
+  current = RT;
+}
+
+bool is_current_version(const std::string &name,
+                        const std::string &version) {
+  std::lock_guard<std::mutex> lock(StubsMutex);
+  return CurrentVersions[name] == version;
+}
+
+Expected<bool> redirect_to_tier1(const std::string &name,
+                                 const std::string &version,
+                                 ExecutorAddr addr) {
+  std::lock_guard<std::mutex> lock(StubsMutex);
+  if (CurrentVersions[name] != version)
+    return false;
+  if (auto err = TheJIT->updateStub(name, addr))
+    return std::move(err);
+  Tier1Versions.insert(version);
+  return true;
+}
+
+void flush_definitions() {
+  if (PendingDefinitions.empty())
+    return;
+  auto definitions = std::move(PendingDefinitions);
+  PendingDefinitions.clear();
+
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  auto how = TIERED ? KaleidoscopeJIT::Compile::Fast
+                    : KaleidoscopeJIT::Compile::Optimize;
+  ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), TheTSC),
+                              RT, how));
+  release_context();
+
+  // the stubs have to exist before the batch refers to them
+  for (auto &[name, version] : definitions)
+    ExitOnErr(TheJIT->addStub(name));
+  for (auto &[name, version] : definitions)
+    publish_version(name, version, RT);
+  initialize_module_for_jit();
+}
+#endif
+
+#ifndef COMPILATION
+// Once a redefinition has been generated, the version of name still waiting
+// for its batch is simply dropped. Published versions stay in use until the
+// new one replaces them.
+static void drop_pending_version(const std::string &name) {
+  auto pending = std::find_if(
+      PendingDefinitions.begin(), PendingDefinitions.end(),
+      [&](const auto &definition) { return definition.first == name; });
+  if (pending != PendingDefinitions.end()) {
+    TheModule->getFunction(pending->second)->eraseFromParent();
+    PendingDefinitions.erase(pending);
   }
 }
+#endif
 
 /// numberexpr ::= number
 static std::unique_ptr<ExprAST> parse_number_expr() {
@@ -70,7 +201,36 @@ static std::unique_ptr<ExprAST> parse_if_expr() {
                                      std::move(else_));
 }
 
-static std::unique_ptr<ExprAST> parse_for_expr() {
+/// hint ::= ('unroll' | 'vectorize' | 'interleave') number
+static bool parse_loop_hints(LoopHints &hints) {
+  while (cur_tok == tok_identifier) {
+    unsigned *hint;
+    if (identifier_str == "unroll")
+      hint = &hints.Unroll;
+    else if (identifier_str == "vectorize")
+      hint = &hints.Vectorize;
+    else if (identifier_str == "interleave")
+      hint = &hints.Interleave;
+    else
+      break;
+
+    auto name = identifier_str;
+    get_next_token(); // eat hint name
+
+    if (cur_tok != tok_number || num_val < 1 || num_val > 1024 ||
+        num_val != (unsigned)num_val) {
+      log_error(
+          std::format("Expected a count from 1 to 1024 after `{}`.", name)
+              .c_str());
+      return false;
+    }
+    *hint = num_val;
+    get_next_token(); // eat number
+  }
+  return true;
+}
+
+static std::unique_ptr<ExprAST> parse_for_expr(std::string reduction = "") {
 
   get_next_token(); // eat for
 
@@ -108,6 +268,10 @@ static std::unique_ptr<ExprAST> parse_for_expr() {
   if (!step)
     return nullptr;
 
+  LoopHints hints;
+  if (!parse_loop_hints(hints))
+    return nullptr;
+
   if (cur_tok != tok_do)
     return log_error("Expected `do` in for statement.");
 
@@ -124,7 +288,267 @@ static std::unique_ptr<ExprAST> parse_for_expr() {
 
   return std::make_unique<ForExprAST>(var, std::move(start),
                                       std::move(condition), std::move(step),
-                                      std::move(body));
+                                      std::move(body), std::move(reduction),
+                                      hints);
+}
+
+/// whileexpr ::= 'while' expression 'do' expression 'end'
+static std::unique_ptr<ExprAST> parse_while_expr() {
+  get_next_token(); // eat while
+
+  auto condition = parse_expression();
+  if (!condition)
+    return nullptr;
+
+  if (cur_tok != tok_do)
+    return log_error("Expected `do` in while statement.");
+
+  get_next_token(); // eat do
+
+  auto body = parse_expression();
+  if (!body)
+    return nullptr;
+
+  if (cur_tok != tok_end)
+    return log_error("Missing `end`.");
+
+  get_next_token(); // eat end
+
+  return std::make_unique<WhileExprAST>(std::move(condition), std::move(body));
+}
+
+// Whether the current token starts the optional value of `break`/`continue`
+static bool is_expression_start() {
+  switch (cur_tok) {
+  case tok_identifier:
+  case tok_number:
+  case '(':
+  case tok_if:
+  case tok_for:
+  case tok_while:
+  case tok_with:
+  case tok_match:
+    return true;
+  case tok_operator:
+    return operator_name == "-" || operator_name == "!" ||
+           FunctionProtos.count("unary" + operator_name);
+  default:
+    return false;
+  }
+}
+
+/// breakexpr ::= 'break' expression?
+/// continueexpr ::= 'continue' expression?
+static std::unique_ptr<ExprAST> parse_loop_jump_expr() {
+  bool is_break = cur_tok == tok_break;
+  auto loc = cur_loc;
+  get_next_token(); // eat break/continue
+
+  std::unique_ptr<ExprAST> value;
+  if (is_expression_start()) {
+    value = parse_expression();
+    if (!value)
+      return nullptr;
+  }
+
+  if (is_break)
+    return std::make_unique<BreakExprAST>(loc, std::move(value));
+  return std::make_unique<ContinueExprAST>(loc, std::move(value));
+}
+
+// number ::= ['-'] number
+static bool parse_signed_number(double &value) {
+  bool negative = cur_tok == tok_operator && operator_name == "-";
+  if (negative)
+    get_next_token(); // eat -
+
+  if (cur_tok != tok_number)
+    return false;
+
+  value = negative ? -num_val : num_val;
+  get_next_token(); // eat number
+  return true;
+}
+
+/// pattern
+///   ::= number (',' number)*
+///   ::= number? 'to' number?
+static bool parse_match_pattern(MatchArm &arm) {
+  double value;
+  if (parse_signed_number(value)) {
+    if (cur_tok != tok_identifier || identifier_str != "to") {
+      arm.Keys.push_back(value);
+      while (cur_tok == ',') {
+        get_next_token(); // eat ,
+        if (!parse_signed_number(value)) {
+          log_error("Expected a number after ',' in `when`.");
+          return false;
+        }
+        arm.Keys.push_back(value);
+      }
+      return true;
+    }
+    arm.Low = value;
+  }
+
+  if (cur_tok != tok_identifier || identifier_str != "to") {
+    log_error("Expected keys or a `to` range after `when`.");
+    return false;
+  }
+  get_next_token(); // eat to
+
+  if (parse_signed_number(value))
+    arm.High = value;
+  else if (!arm.Low) {
+    log_error("A `to` range needs at least one bound.");
+    return false;
+  }
+  return true;
+}
+
+// Keys and bounds become i64 switch cases, and above 2^53 doubles stop
+// telling consecutive integers apart
+static constexpr double MATCH_MAX_MAGNITUDE = 9007199254740992.0;
+
+static bool check_match_magnitude(double value) {
+  if (std::fabs(value) <= MATCH_MAX_MAGNITUDE)
+    return true;
+  log_error("`match` keys and bounds must be within 2^53.");
+  return false;
+}
+
+// Keys must be distinct integers, ranges must be non-empty and disjoint, and
+// both kinds can not be mixed
+static bool check_match_arms(const std::vector<MatchArm> &arms) {
+  bool has_keys = false, has_ranges = false;
+  std::set<double> keys;
+  std::vector<std::pair<double, double>> ranges;
+  for (auto &arm : arms) {
+    if (arm.Keys.empty()) {
+      has_ranges = true;
+      if ((arm.Low && !check_match_magnitude(*arm.Low)) ||
+          (arm.High && !check_match_magnitude(*arm.High)))
+        return false;
+      double low = arm.Low.value_or(-HUGE_VAL);
+      double high = arm.High.value_or(HUGE_VAL);
+      if (!(low < high)) {
+        log_error("Empty range in `match`.");
+        return false;
+      }
+      ranges.emplace_back(low, high);
+      continue;
+    }
+
+    has_keys = true;
+    for (double key : arm.Keys) {
+      if (std::trunc(key) != key) {
+        log_error("`match` keys must be integers.");
+        return false;
+      }
+      if (!check_match_magnitude(key))
+        return false;
+      if (!keys.insert(key).second) {
+        log_error("Duplicate key in `match`.");
+        return false;
+      }
+    }
+  }
+
+  if (has_keys && has_ranges) {
+    log_error("`match` can not mix keys and ranges.");
+    return false;
+  }
+
+  std::sort(ranges.begin(), ranges.end());
+  for (size_t i = 1; i < ranges.size(); ++i)
+    if (ranges[i].first < ranges[i - 1].second) {
+      log_error("Overlapping ranges in `match`.");
+      return false;
+    }
+  return true;
+}
+
+/// matchexpr
+///   ::= 'match' expression ('when' pattern 'then' expression)+
+///       ['else' expression] 'end'
+static std::unique_ptr<ExprAST> parse_match_expr() {
+  get_next_token(); // eat match
+
+  auto key = parse_expression();
+  if (!key)
+    return nullptr;
+
+  std::vector<MatchArm> arms;
+  while (cur_tok == tok_when) {
+    get_next_token(); // eat when
+
+    MatchArm arm;
+    if (!parse_match_pattern(arm))
+      return nullptr;
+
+    if (cur_tok != tok_then)
+      return log_error("Expected `then` after `when` pattern.");
+    get_next_token(); // eat then
+
+    arm.Body = parse_expression();
+    if (!arm.Body)
+      return nullptr;
+    arms.push_back(std::move(arm));
+  }
+
+  if (arms.empty())
+    return log_error("Expected `when` after `match` key.");
+  if (!check_match_arms(arms))
+    return nullptr;
+
+  std::unique_ptr<ExprAST> else_;
+  if (cur_tok == tok_else) {
+    get_next_token(); // eat else
+    else_ = parse_expression();
+    if (!else_)
+      return nullptr;
+  }
+
+  if (cur_tok != tok_end)
+    return log_error("Missing `end`.");
+  get_next_token(); // eat end
+
+  return std::make_unique<MatchExprAST>(std::move(key), std::move(arms),
+                                        std::move(else_));
+}
+
+static bool parse_layout(RecordLayout &layout) {
+  if (cur_tok == tok_identifier && identifier_str == "soa")
+    layout = RecordLayout::SoA;
+  else if (cur_tok == tok_identifier && identifier_str == "aos")
+    layout = RecordLayout::AoS;
+  else {
+    log_error("Expected `soa` or `aos` after `layout`.");
+    return false;
+  }
+  get_next_token(); // eat soa/aos
+  return true;
+}
+
+/// recordarray ::= record_name '(' expression ')' ['layout' ('soa' | 'aos')]
+static std::unique_ptr<ExprAST>
+parse_record_array_expr(const RecordAST *record) {
+  if (cur_tok != '(')
+    return log_error("Expected '(' size ')' after record name.");
+
+  auto count = parse_paren_expr();
+  if (!count)
+    return nullptr;
+
+  auto layout = record->get_layout();
+  if (cur_tok == tok_identifier && identifier_str == "layout") {
+    get_next_token(); // eat layout
+    if (!parse_layout(layout))
+      return nullptr;
+  }
+
+  return std::make_unique<RecordArrayExprAST>(record, std::move(count),
+                                              layout);
 }
 
 static std::unique_ptr<ExprAST> parse_with_expr() {
@@ -142,7 +566,16 @@ static std::unique_ptr<ExprAST> parse_with_expr() {
     std::unique_ptr<ExprAST> initial_val;
     if (cur_tok == tok_operator && operator_name == "=") {
       get_next_token(); // eat =
-      initial_val = parse_expression();
+      // only here does a record name make an array rather than name a call
+      auto record = cur_tok == tok_identifier
+                        ? RecordTypes.find(identifier_str)
+                        : RecordTypes.end();
+      if (record != RecordTypes.end()) {
+        get_next_token(); // eat record name
+        initial_val = parse_record_array_expr(record->second.get());
+      } else {
+        initial_val = parse_expression();
+      }
       if (!initial_val)
         return nullptr;
     }
@@ -174,12 +607,32 @@ static std::unique_ptr<ExprAST> parse_with_expr() {
 /// identifierexpr
 ///   ::= identifier  // simple variable ref
 ///   ::= identifier '(' expression* ')' // function call
+///   ::= identifier '.' identifier '(' expression ')' // record field
 static std::unique_ptr<ExprAST> parse_identifier_expr() {
   std::string id_name = identifier_str;
   auto fn_call_loc = cur_loc;
 
   get_next_token(); // eat identifier.
 
+  // `sum`, `prod`, `min` and `max` are only keywords right before `for`
+  if (cur_tok == tok_for && ForExprAST::is_reduction(id_name))
+    return parse_for_expr(id_name);
+
+  if (cur_tok == '.') {
+    get_next_token(); // eat .
+    if (cur_tok != tok_identifier)
+      return log_error("Expected field name after '.'.");
+    std::string field_name = identifier_str;
+    get_next_token(); // eat field name
+    if (cur_tok != '(')
+      return log_error("Expected '(' index ')' after record field.");
+    auto index = parse_paren_expr();
+    if (!index)
+      return nullptr;
+    return std::make_unique<FieldExprAST>(fn_call_loc, id_name, field_name,
+                                          std::move(index));
+  }
+
   if (cur_tok != '(') // Simple variable ref.
     return std::make_unique<VariableExprAST>(id_name);
 
@@ -226,6 +679,13 @@ static std::unique_ptr<ExprAST> parse_primary() {
     return parse_for_expr();
   case tok_with:
     return parse_with_expr();
+  case tok_while:
+    return parse_while_expr();
+  case tok_match:
+    return parse_match_expr();
+  case tok_break:
+  case tok_continue:
+    return parse_loop_jump_expr();
   default:
     return log_error("unknown token when expecting an expression");
   }
@@ -291,12 +751,15 @@ static std::unique_ptr<ExprAST> parse_binop_rhs(int expr_prec,
     if (!RHS)
       return nullptr;
     // If BinOp binds less tightly with RHS than the operator after RHS, let
-    // the pending operator take RHS as its LHS.
+    // the pending operator take RHS as its LHS. `^` is right associative, as
+    // in maths: 2^3^2 is 2^(3^2).
     int next_prec = get_tok_precedence();
-    if (tok_prec < next_prec) {
+    bool right_assoc = binop == "^" && tok_prec == next_prec;
+    if (tok_prec < next_prec || right_assoc) {
       // tok_prec + 1 because anything with the current precedence should not be
-      // parsed in the LHS
-      RHS = parse_binop_rhs(tok_prec + 1, std::move(RHS));
+      // parsed in the LHS, unless it is on the right of `^`
+      RHS = parse_binop_rhs(right_assoc ? tok_prec : tok_prec + 1,
+                            std::move(RHS));
       if (!RHS)
         return nullptr;
     }
@@ -318,17 +781,44 @@ static std::unique_ptr<ExprAST> parse_expression() {
 }
 
 /// prototype
-///   ::= id '(' id* ')'
+///   ::= attribute* id '(' id* ')'
+///   ::= attribute* binary LETTER number? (id, id)
+///   ::= attribute* unary LETTER (id)
+/// attribute
+///   ::= 'pure' | 'readonly' | 'inline' | 'noinline' | 'hot' | 'cold'
 static std::unique_ptr<PrototypeAST> parse_prototype() {
 
   std::string fn_name;
   SourceLocation def_loc = cur_loc;
   unsigned char kind = 0;   // 0 = identifier, 1 = unary, 2 = binary
   unsigned precedence = 30; // default precedence
+  unsigned attributes = 0;
+
+  while (cur_tok == tok_identifier) {
+    unsigned attribute = PrototypeAST::get_attribute(identifier_str);
+    if (!attribute)
+      break;
+    fn_name = identifier_str;
+    get_next_token(); // eat attribute
+    if (cur_tok == '(')
+      break; // it was the name of the function after all
+    attributes |= attribute;
+    fn_name.clear();
+  }
+
+  if ((attributes & PrototypeAST::Inline) &&
+      (attributes & PrototypeAST::NoInline))
+    return log_error_p("A function can not be both `inline` and `noinline`");
+  if ((attributes & PrototypeAST::Hot) && (attributes & PrototypeAST::Cold))
+    return log_error_p("A function can not be both `hot` and `cold`");
 
   switch (cur_tok) {
   default:
     return log_error_p("Expected function name in prototype");
+  case '(': // function named like an attribute
+    if (fn_name.empty())
+      return log_error_p("Expected function name in prototype");
+    break;
   case tok_identifier:
     fn_name = identifier_str;
     get_next_token(); // expect '('
@@ -372,7 +862,7 @@ static std::unique_ptr<PrototypeAST> parse_prototype() {
     return log_error_p("Invalid number of operands for operator.");
 
   return std::make_unique<PrototypeAST>(def_loc, fn_name, std::move(arg_names),
-                                        kind != 0, precedence);
+                                        kind != 0, precedence, attributes);
 }
 
 /// definition ::= 'def' prototype expression
@@ -382,7 +872,6 @@ static std::unique_ptr<FunctionAST> parse_definition() {
   if (!proto)
     return nullptr;
 
-  delete_function_if_exists(proto->get_name());
   if (auto E = parse_expression())
     return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
   return nullptr;
@@ -394,13 +883,65 @@ static std::unique_ptr<PrototypeAST> parse_extern() {
   return parse_prototype();
 }
 
+/// record ::= 'record' identifier '(' (['int' | 'double'] identifier)* ')'
+///              ['layout' ('soa' | 'aos')]
+static std::unique_ptr<RecordAST> parse_record() {
+  get_next_token(); // eat record.
+
+  if (cur_tok != tok_identifier)
+    return log_error_r("Expected record name after `record`.");
+
+  std::string record_name = identifier_str;
+  get_next_token(); // eat identifier
+
+  if (cur_tok != '(')
+    return log_error_r("Expected '(' in record declaration.");
+
+  std::vector<RecordField> fields;
+  bool is_int = false;
+  while (get_next_token() == tok_identifier) {
+    if (identifier_str == "int" || identifier_str == "double") {
+      is_int = identifier_str == "int";
+      continue;
+    }
+    for (auto &field : fields)
+      if (field.Name == identifier_str)
+        return log_error_r(
+            std::format("Duplicate field {} in record {}.", identifier_str,
+                        record_name)
+                .c_str());
+
+    fields.push_back({identifier_str, is_int});
+    is_int = false;
+  }
+
+  if (cur_tok != ')')
+    return log_error_r("Expected ')' in record declaration.");
+  get_next_token(); // eat ')'
+
+  if (fields.empty())
+    return log_error_r("Record should have at least one field.");
+
+  auto layout = RecordLayout::AoS;
+  if (cur_tok == tok_identifier && identifier_str == "layout") {
+    get_next_token(); // eat layout
+    if (!parse_layout(layout))
+      return nullptr;
+  }
+
+  return std::make_unique<RecordAST>(record_name, std::move(fields), layout);
+}
+
 /// toplevelexpr ::= expression
 static std::unique_ptr<FunctionAST> parse_top_level_expression() {
   SourceLocation def_loc = cur_loc;
   if (auto E = parse_expression()) {
     // Make an anonymous proto.
-    auto proto = std::make_unique<PrototypeAST>(def_loc, ANON_FUNCTION,
-                                                std::vector<std::string>());
+    // unique, so that several expressions can be in the JIT at once
+    static unsigned anon_expressions = 0;
+    auto proto = std::make_unique<PrototypeAST>(
+        def_loc, std::format("{}.{}", ANON_FUNCTION, ++anon_expressions),
+        std::vector<std::string>());
     return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
   }
   return nullptr;
@@ -413,6 +954,7 @@ static std::unique_ptr<FunctionAST> parse_top_level_expression() {
 void handle_definition() {
   if (auto func = parse_definition()) {
     std::string function_name = func->get_name();
+    auto start = std::chrono::steady_clock::now();
     if (auto *IR = func->codegen()) {
       if (VERBOSE) {
         fprintf(stderr, "Read function definition:\n");
@@ -420,14 +962,22 @@ void handle_definition() {
         fprintf(stderr, "\n");
       }
 #ifndef COMPILATION
-      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-      auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      initialize_modules_and_managers_for_jit();
-
-      FunctionRTs[function_name] = &RT;
+      drop_pending_version(function_name);
+      auto version = split_version(*IR);
+      if (TIERED)
+        instrument_tier0(*TheModule->getFunction(version), function_name);
+      PendingDefinitions.emplace_back(function_name, version);
+      if (PendingDefinitions.size() >= BATCH_SIZE)
+        flush_definitions();
 #endif
     }
+    // codegen, the passes and handing the module over to the JIT
+    if (TIME) {
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      fprintf(stderr, "\rTime (%s): %.3f ms\n", function_name.c_str(),
+              elapsed.count());
+    }
   } else {
     // Skip token for error recovery.
     get_next_token();
@@ -450,24 +1000,52 @@ void handle_extern() {
   }
 }
 
+void handle_record() {
+  if (auto record = parse_record()) {
+    if (VERBOSE)
+      fprintf(stderr, "Read record %s with %zu fields\n",
+              record->get_name().c_str(), record->get_fields().size());
+    RecordTypes[record->get_name()] = std::move(record);
+  } else {
+    // Skip token for error recovery.
+    get_next_token();
+  }
+}
+
 void handle_top_level_expression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto expr = parse_top_level_expression()) {
+#ifndef COMPILATION
+    flush_definitions(); // before the expression can call them
+    auto start = std::chrono::steady_clock::now();
+#endif
+    std::string name = expr->get_name();
     if (expr->codegen()) {
 
 #ifndef COMPILATION
       auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-      auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      initialize_modules_and_managers_for_jit();
-
-      auto expr_symbol = ExitOnErr(TheJIT->lookup(ANON_FUNCTION));
+      auto TSM = ThreadSafeModule(std::move(TheModule), TheTSC);
+      ExitOnErr(TheJIT->addModule(std::move(TSM), RT,
+                                  KaleidoscopeJIT::Compile::Once));
+      release_context();
+
+      auto expr_symbol = ExitOnErr(TheJIT->lookup(name));
+      // codegen and compiling, without running it
+      if (TIME) {
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "\rTime (%s): %.3f ms\n", name.c_str(),
+                elapsed.count());
+      }
 
       auto fp = expr_symbol.getAddress().toPtr<double (*)()>();
 
       fprintf(stderr, VERBOSE ? "\r  \tEvaluated to: %lf\n" : "\r  \t%lf\n",
               fp());
       ExitOnErr(RT->remove());
+      FunctionProtos.erase(name);
+      forget_function_ir(name);
+      initialize_module_for_jit();
 #endif
     }
   } else {
@@ -1,9 +1,25 @@
 #ifndef PARSER_H
 #define PARSER_H
+#include "include/Kaleidoscope.h"
 #include "lex.h"
+#include <string>
 
 extern int cur_tok;
 inline int get_next_token() { return cur_tok = gettok(); }
-void handle_definition(), handle_extern(), handle_top_level_expression();
+void handle_definition(), handle_extern(), handle_record(),
+    handle_top_level_expression();
+// Hands the definitions batched so far (KPP_BATCH) to the JIT
+void flush_definitions();
+
+#ifndef COMPILATION
+// Whether version still holds the body of name
+bool is_current_version(const std::string &name, const std::string &version);
+// Points the stub of name at the optimised code of the version, unless the
+// function has been redefined since (false). It runs on the JIT workers, so
+// a failure comes back to the caller to report.
+llvm::Expected<bool> redirect_to_tier1(const std::string &name,
+                                       const std::string &version,
+                                       llvm::orc::ExecutorAddr addr);
+#endif
 
 #endif
@@ -1,9 +1,17 @@
+#include "ast.h"
+#include "cache.h"
 #include "include/Kaleidoscope.h"
 #include "internal.h"
 #include "lex.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "tier.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include <fstream>
+#include <optional>
 #include <sstream>
 
 using namespace llvm;
@@ -44,6 +52,9 @@ static void handle_unit() {
     case tok_extern:
       handle_extern();
       break;
+    case tok_record:
+      handle_record();
+      break;
     default:
       handle_top_level_expression();
       break;
@@ -51,24 +62,101 @@ static void handle_unit() {
   }
 }
 
+static std::optional<sys::TimePoint<>> modified(const char *path) {
+  sys::fs::file_status status;
+  if (sys::fs::status(path, status))
+    return std::nullopt;
+  return status.getLastModificationTime();
+}
+
+// Whether every file `make all` builds exists and is newer than the sources
+static bool library_is_current() {
+  for (auto *built : {"lib/klpp.a", "lib/klpp.hkl", "lib/klpp.bc"}) {
+    auto built_at = modified(built);
+    if (!built_at)
+      return false;
+    for (auto *source :
+         {"lib/core.kl", "lib/builtin.kl", "lib/core.hkl", "lib/external.cpp"})
+      if (auto changed_at = modified(source);
+          changed_at && *changed_at > *built_at) {
+        fprintf(stderr,
+                "\rWarning: %s is older than %s, compiling the library "
+                "(make all to rebuild it)\n",
+                built, source);
+        return false;
+      }
+  }
+  return true;
+}
+
+// Links lib/klpp.a, built by `make all`, instead of compiling lib/core.kl
+// and lib/builtin.kl again: lib/klpp.hkl declares their functions and the
+// IR in lib/klpp.bc is saved for inlining, as that of the definitions is.
+// Calls compiled inside the archive keep going to the library's versions
+// of redefined functions. False when any of the files is missing or stale.
+static bool load_library() {
+  if (!library_is_current())
+    return false;
+  auto bitcode = MemoryBuffer::getFile("lib/klpp.bc");
+  if (!bitcode)
+    return false;
+  LLVMContext context;
+  auto library = parseBitcodeFile(**bitcode, context);
+  if (!library) {
+    consumeError(library.takeError());
+    return false;
+  }
+  if (auto err = TheJIT->addStaticLibrary("lib/klpp.a")) {
+    consumeError(std::move(err));
+    return false;
+  }
+
+  set_lex_source(std::make_unique<std::fstream>("lib/klpp.hkl"));
+  handle_unit();
+
+  (*library)->setTargetTriple(""); // like the JIT modules
+  for (auto &F : **library) {
+    if (F.isDeclaration())
+      continue;
+    // as infer_attributes does for the definitions
+    auto proto = FunctionProtos.find(F.getName().str());
+    if (proto != FunctionProtos.end()) {
+      proto->second->record_inferred_attributes(F);
+      proto->second->record_returned_argument(F);
+    }
+    save_function_ir(F);
+  }
+  return true;
+}
+
 int main() {
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
+  initialize_options();
 
-  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
-  initialize_modules_and_managers_for_jit();
+  TheJIT =
+      ExitOnErr(KaleidoscopeJIT::Create(JIT_THREADS, create_object_cache()));
+  if (TIERED)
+    initialize_tiering();
+  if (OPT_LEVEL >= 0)
+    TheJIT->setOptimizer([](Module &M, TargetMachine &TM) {
+      optimize_module(M, OPT_LEVEL, &TM);
+    });
+  initialize_jit();
 
   fprintf(stderr, REPL_STR);
 
   set_lex_source(std::make_unique<std::fstream>("lib/core.hkl"));
   handle_unit();
 
-  set_lex_source(std::make_unique<std::fstream>("lib/core.kl"));
-  handle_unit();
+  if (!load_library()) {
+    set_lex_source(std::make_unique<std::fstream>("lib/core.kl"));
+    handle_unit();
 
-  set_lex_source(std::make_unique<std::fstream>("lib/builtin.kl"));
-  handle_unit();
+    set_lex_source(std::make_unique<std::fstream>("lib/builtin.kl"));
+    handle_unit();
+  }
 
   auto str_stream = std::make_unique<std::stringstream>();
   auto &ss = *str_stream;
@@ -79,5 +167,6 @@ int main() {
     ss.clear();
   }
 
+  release_context(); // the workers finish before the JIT goes away
   return 0;
 }
@@ -0,0 +1,107 @@
+#include "ssa.h"
+#include "internal.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+
+SSABuilder SSA;
+
+void SSABuilder::reset() {
+  Variables.clear();
+  Sealed.clear();
+  IncompletePhis.clear();
+}
+
+LocalVariable *SSABuilder::create(Function *f, StringRef name) {
+  auto &var = Variables.emplace_back();
+  var.Name = name.str();
+  if (DEBUG)
+    var.Alloca = create_entry_block_alloca(f, name);
+  return &var;
+}
+
+Value *SSABuilder::read(LocalVariable *var) {
+  if (var->Alloca)
+    return Builder->CreateLoad(Type::getDoubleTy(*TheContext), var->Alloca,
+                               var->Name);
+  return read_in(*var, Builder->GetInsertBlock());
+}
+
+void SSABuilder::write(LocalVariable *var, Value *value) {
+  if (var->Alloca)
+    Builder->CreateStore(value, var->Alloca);
+  else
+    var->Definitions[Builder->GetInsertBlock()] = value;
+}
+
+Value *SSABuilder::read_in(LocalVariable &var, BasicBlock *block) {
+  auto def = var.Definitions.find(block);
+  if (def != var.Definitions.end() && def->second)
+    return def->second;
+  return read_recursive(var, block);
+}
+
+Value *SSABuilder::read_recursive(LocalVariable &var, BasicBlock *block) {
+  auto *type = Type::getDoubleTy(*TheContext);
+  Value *value;
+  if (!Sealed.contains(block)) {
+    auto *phi = PHINode::Create(type, 0, var.Name, block->begin());
+    IncompletePhis[block].emplace_back(&var, phi);
+    value = phi;
+  } else if (auto *pred = block->getUniquePredecessor()) {
+    value = read_in(var, pred);
+  } else if (pred_empty(block)) {
+    value = PoisonValue::get(type); // unreachable
+  } else {
+    // recorded first, so that reads coming around a loop end here
+    auto *phi = PHINode::Create(type, pred_size(block), var.Name,
+                                block->begin());
+    var.Definitions[block] = phi;
+    value = add_phi_operands(var, phi, true);
+  }
+  var.Definitions[block] = value;
+  return value;
+}
+
+// Fills a PHI from the predecessors and replaces it when it only forwards a
+// single value. A PHI completed by seal() may still be held by the code
+// generator, so it is only erased when it has just been created.
+Value *SSABuilder::add_phi_operands(LocalVariable &var, PHINode *phi,
+                                    bool erase) {
+  for (auto *pred : predecessors(phi->getParent()))
+    phi->addIncoming(read_in(var, pred), pred);
+
+  Value *same = nullptr;
+  for (Value *op : phi->incoming_values()) {
+    if (op == same || op == phi)
+      continue;
+    if (same)
+      return phi; // merges at least two values
+    same = op;
+  }
+  if (!same)
+    same = PoisonValue::get(phi->getType());
+
+  phi->replaceAllUsesWith(same);
+  if (erase)
+    phi->eraseFromParent();
+  return same;
+}
+
+void SSABuilder::seal(BasicBlock *block) {
+  if (!Sealed.insert(block).second)
+    return;
+
+  auto incomplete = IncompletePhis.find(block);
+  if (incomplete == IncompletePhis.end())
+    return;
+  auto phis = std::move(incomplete->second);
+  IncompletePhis.erase(incomplete);
+  for (auto &[var, phi] : phis)
+    add_phi_operands(*var, phi, false);
+}
+
+// Every predecessor is known once the whole function is generated
+void SSABuilder::seal_all(Function &f) {
+  for (auto &block : f)
+    seal(&block);
+}
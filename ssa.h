@@ -0,0 +1,58 @@
+#ifndef SSA_H
+#define SSA_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/ValueHandle.h"
+#include <deque>
+#include <string>
+#include <utility>
+
+using namespace llvm;
+
+// A local of the function being generated: a parameter, a `for` variable, a
+// `with` binding or a value the code generator carries around a loop.
+struct LocalVariable {
+  std::string Name;
+  AllocaInst *Alloca = nullptr; // only with DEBUG, for the debugger
+  // Value at the end of each block that assigns or reads the variable.
+  // Trivial PHIs are replaced behind the handles.
+  DenseMap<BasicBlock *, WeakTrackingVH> Definitions;
+};
+
+// Builds SSA form while the IR is emitted, following Braun et al., "Simple
+// and Efficient Construction of Static Single Assignment Form" (CC 2013),
+// so there are no allocas left for mem2reg to promote.
+//
+// A block is sealed once all of its predecessors branch to it. Reading a
+// variable in a block that is not sealed yet creates a PHI whose operands
+// are filled in by seal(). With DEBUG the variables stay in allocas
+// instead, where the debugger can find them.
+class SSABuilder {
+  std::deque<LocalVariable> Variables;
+  DenseSet<BasicBlock *> Sealed;
+  DenseMap<BasicBlock *, SmallVector<std::pair<LocalVariable *, PHINode *>>>
+      IncompletePhis;
+
+  Value *read_in(LocalVariable &var, BasicBlock *block);
+  Value *read_recursive(LocalVariable &var, BasicBlock *block);
+  Value *add_phi_operands(LocalVariable &var, PHINode *phi, bool erase);
+
+public:
+  void reset(); // before generating a function
+
+  LocalVariable *create(Function *f, StringRef name);
+  // at the insertion point of the Builder
+  Value *read(LocalVariable *var);
+  void write(LocalVariable *var, Value *value);
+
+  void seal(BasicBlock *block);
+  void seal_all(Function &f);
+};
+
+extern SSABuilder SSA;
+
+#endif
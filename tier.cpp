@@ -0,0 +1,167 @@
+#include "tier.h"
+#include "internal.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#ifndef COMPILATION
+
+#define TIER_UP_HOOK "__kpp_tier_up"
+
+// A tier 0 version with its counter, which the generated code increments
+struct TieredVersion {
+  std::string Name, Version;
+  std::string Bitcode; // as generated, before the counters
+  std::atomic<uint64_t> Count = 0;
+};
+static std::deque<TieredVersion> TieredVersions;
+
+static std::mutex Tier1Mutex;
+static std::map<std::string, ResourceTrackerSP> Tier1RTs;
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// The workers cannot stop the session, tier 0 simply stays in use
+static void log_tier1_error(const std::string &name, Error err) {
+  fprintf(stderr, "\rError: tier 1 of %s: %s\n", name.c_str(),
+          toString(std::move(err)).c_str());
+}
+
+// Runs on a JIT worker, in a context of its own
+static void compile_tier1(const TieredVersion &tiered) {
+  auto start = std::chrono::steady_clock::now();
+  std::string name = tiered.Name, version = tiered.Version;
+
+  auto context = std::make_unique<LLVMContext>();
+  auto M =
+      parseBitcodeFile(MemoryBufferRef(tiered.Bitcode, version), *context);
+  if (!M) {
+    consumeError(M.takeError());
+    return;
+  }
+  Function *F = (*M)->getFunction(version);
+  inline_saved_callees(*F);
+  optimize_module(**M, 3);
+  std::string tier1 = version + "$tier1";
+  F->setName(tier1);
+
+  {
+    // retire_tier1 of a redefinition either comes before, and the version
+    // is not current any more, or waits and finds the tracker
+    std::lock_guard<std::mutex> lock(Tier1Mutex);
+    if (!is_current_version(name, version))
+      return;
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    if (auto err = TheJIT->addModule(
+            ThreadSafeModule(std::move(*M),
+                             ThreadSafeContext(std::move(context))),
+            RT, KaleidoscopeJIT::Compile::Optimized)) {
+      log_tier1_error(name, std::move(err));
+      return;
+    }
+    Tier1RTs[version] = RT;
+  }
+  TheJIT->lookupAsync(tier1, [=](Expected<ExecutorAddr> addr) {
+    if (!addr)
+      return consumeError(addr.takeError());
+    auto redirected = redirect_to_tier1(name, version, *addr);
+    if (!redirected) {
+      log_tier1_error(name, redirected.takeError());
+      retire_tier1(version);
+      return;
+    }
+    if (!*redirected) {
+      retire_tier1(version); // redefined meanwhile
+      return;
+    }
+    fprintf(stderr, "\rTier up (%s): optimised in %.3f ms\n", name.c_str(),
+            elapsed_ms(start));
+  });
+}
+
+// Called by the generated code once a counter reaches the threshold
+static void tier_up(uint64_t id) {
+  auto &tiered = TieredVersions[id];
+  fprintf(stderr, "\rTier up (%s): %llu calls and iterations\n",
+          tiered.Name.c_str(), (unsigned long long)tiered.Count.load());
+  TheJIT->runInBackground([&tiered] { compile_tier1(tiered); });
+}
+
+void initialize_tiering() {
+  ExitOnErr(TheJIT->addHostFunction(TIER_UP_HOOK, (void *)&tier_up));
+}
+
+// count += 1, calling the hook when it reaches the threshold
+static void insert_count(Instruction *before, TieredVersion &tiered,
+                         uint64_t id) {
+  IRBuilder<> builder(before);
+  auto *i64 = builder.getInt64Ty();
+  auto *counter = builder.CreateIntToPtr(
+      builder.getInt64((uint64_t)&tiered.Count), builder.getPtrTy());
+  auto *old = builder.CreateAtomicRMW(AtomicRMWInst::Add, counter,
+                                      builder.getInt64(1), MaybeAlign(8),
+                                      AtomicOrdering::Monotonic);
+  auto *reached =
+      builder.CreateICmpEQ(old, builder.getInt64(TIER_THRESHOLD - 1));
+
+  auto *then = SplitBlockAndInsertIfThen(reached, before, false);
+  builder.SetInsertPoint(then);
+  auto hook = before->getModule()->getOrInsertFunction(
+      TIER_UP_HOOK, builder.getVoidTy(), i64);
+  builder.CreateCall(hook, {builder.getInt64(id)});
+}
+
+void instrument_tier0(Function &version, const std::string &name) {
+  uint64_t id = TieredVersions.size();
+  auto &tiered = TieredVersions.emplace_back();
+  tiered.Name = name;
+  tiered.Version = version.getName().str();
+
+  ValueToValueMapTy VMap;
+  auto M = CloneModule(*version.getParent(), VMap,
+                       [&](const GlobalValue *GV) { return GV == &version; });
+  raw_string_ostream os(tiered.Bitcode);
+  WriteBitcodeToFile(*M, os);
+  os.flush();
+
+  // the entry and every backedge
+  DominatorTree DT(version);
+  std::vector<Instruction *> sites{
+      &*version.getEntryBlock().getFirstInsertionPt()};
+  for (auto &block : version)
+    for (auto *succ : successors(&block))
+      if (DT.dominates(succ, &block)) {
+        sites.push_back(block.getTerminator());
+        break;
+      }
+  for (auto *site : sites)
+    insert_count(site, tiered, id);
+}
+
+void retire_tier1(const std::string &version) {
+  std::lock_guard<std::mutex> lock(Tier1Mutex);
+  auto tier1 = Tier1RTs.find(version);
+  if (tier1 == Tier1RTs.end())
+    return;
+  if (auto err = tier1->second->remove())
+    log_tier1_error(version, std::move(err));
+  Tier1RTs.erase(tier1);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include "llvm/IR/Function.h"
+#include <string>
+
+using namespace llvm;
+
+// Tiered compilation (KPP_TIERED=1). Tier 0 is the IR as generated, compiled
+// without optimisation and counting calls and loop iterations. A version
+// whose count reaches KPP_TIER_THRESHOLD is optimised at O3 in the
+// background and its stub repointed at the result. Without JIT workers
+// (KPP_JIT_THREADS=0) it would be optimised in the middle of the hot code,
+// so tiering is turned off.
+//
+// Tier 0 does not infer attributes either, so the callers of a function
+// only get those written in its prototype, without `nounwind`.
+
+void initialize_tiering();
+
+// Keeps the IR of the version of name for tier 1 and adds the counters
+void instrument_tier0(Function &version, const std::string &name);
+
+// Drops the tier 1 code of a version which has been redefined
+void retire_tier1(const std::string &version);
+
+#endif